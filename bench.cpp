@@ -0,0 +1,561 @@
+#include <algorithm>
+#include <atomic>
+#include <bit>
+#include <charconv>
+#include <chrono>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <exception>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <optional>
+#include <random>
+#include <string>
+#include <string_view>
+#include <system_error>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include <sys/resource.h>
+
+#include "protocol.h"
+#include "socket.h"
+
+// Loads a server with many registered clients, which send each other private messages and
+// broadcasts at a steady rate, and reports how long the messages take to be delivered.
+
+using Clock = std::chrono::steady_clock;
+
+namespace {
+// Counts values with a relative precision of 1/128 over the whole range of 64-bit values, in
+// the way of HdrHistogram: values are grouped by their highest bit, and each group is split
+// into equal sub-buckets. Values under 256 are counted exactly.
+class Histogram {
+private:
+    static constexpr unsigned sub_bucket_bits = 7;
+    static constexpr std::uint64_t sub_bucket_count = 1 << sub_bucket_bits;
+    // The values counted exactly.
+    static constexpr std::uint64_t exact_count = 2 * sub_bucket_count;
+
+    std::vector<std::uint64_t> m_counts =
+        std::vector<std::uint64_t>(exact_count + (64 - sub_bucket_bits - 1) * sub_bucket_count);
+    std::uint64_t m_total = 0;
+    std::uint64_t m_min = UINT64_MAX;
+    std::uint64_t m_max = 0;
+    double m_sum = 0;
+
+    static std::size_t index_of(std::uint64_t v) noexcept {
+        if (v < exact_count) {
+            return v;
+        }
+        // The highest bits of the value, from 128 to 255.
+        const unsigned shift = std::bit_width(v) - sub_bucket_bits - 1;
+        const auto top = v >> shift;
+        return exact_count + (shift - 1) * sub_bucket_count + (top - sub_bucket_count);
+    }
+
+    // The highest value counted at the given index.
+    static std::uint64_t highest_of(std::size_t i) noexcept {
+        if (i < exact_count) {
+            return i;
+        }
+        const auto k = i - exact_count;
+        const unsigned shift = k / sub_bucket_count + 1;
+        const auto top = k % sub_bucket_count + sub_bucket_count;
+        return ((top + 1) << shift) - 1;
+    }
+
+public:
+    void record(std::uint64_t v) noexcept {
+        ++m_counts[index_of(v)];
+        ++m_total;
+        m_min = std::min(m_min, v);
+        m_max = std::max(m_max, v);
+        m_sum += v;
+    }
+
+    void merge(const Histogram& other) noexcept {
+        for (std::size_t i = 0; i < m_counts.size(); ++i) {
+            m_counts[i] += other.m_counts[i];
+        }
+        m_total += other.m_total;
+        m_min = std::min(m_min, other.m_min);
+        m_max = std::max(m_max, other.m_max);
+        m_sum += other.m_sum;
+    }
+
+    std::uint64_t total() const noexcept { return m_total; }
+    std::uint64_t min() const noexcept { return m_total == 0 ? 0 : m_min; }
+    std::uint64_t max() const noexcept { return m_max; }
+    double mean() const noexcept { return m_total == 0 ? 0 : m_sum / m_total; }
+
+    // The value under which the given percentage of the values fall, within the precision.
+    std::uint64_t percentile(double p) const noexcept {
+        const auto rank = std::max<std::uint64_t>(1, std::ceil(p / 100 * m_total));
+        std::uint64_t seen = 0;
+        for (std::size_t i = 0; i < m_counts.size(); ++i) {
+            seen += m_counts[i];
+            if (seen >= rank) {
+                return std::min(highest_of(i), m_max);
+            }
+        }
+        return m_max;
+    }
+};
+
+struct Settings {
+    std::string ip;
+    unsigned short port = 0;
+    std::size_t connections = 1000;
+    std::size_t threads = 1;
+    // Messages per second, from all the clients together.
+    double rate = 1000;
+    // The share of the messages which are broadcasts, the others being private messages to a
+    // random client.
+    double broadcast_ratio = 0.01;
+    // Of the text of each message.
+    std::size_t size = 64;
+    // Messages sent during the warmup are not measured.
+    double warmup_s = 2;
+    double duration_s = 10;
+    // How long deliveries are still waited for once the clients stop sending.
+    double drain_s = 2;
+    // User names are the prefix followed by the index of the client.
+    std::string prefix = "bench";
+    // Identifies the run in the output, for example as the commit of the server.
+    std::string label;
+    // Where the JSON goes, standard output if empty.
+    std::string output;
+};
+
+// Set by the main thread once all clients are registered.
+struct Schedule {
+    Clock::time_point send_from;
+    Clock::time_point measure_from;
+    Clock::time_point measure_until;
+    Clock::time_point drain_until;
+};
+
+struct Shared {
+    std::atomic<std::size_t> registered = 0;
+    std::atomic<bool> is_scheduled = false;
+    Schedule schedule;
+};
+
+struct Results {
+    Histogram latency_ns;
+    // Of the messages sent in the measured window.
+    std::uint64_t sent_private = 0;
+    std::uint64_t sent_broadcast = 0;
+    std::uint64_t delivered = 0;
+    std::uint64_t disconnects = 0;
+    std::uint64_t invalid_frames = 0;
+
+    void merge(const Results& other) noexcept {
+        latency_ns.merge(other.latency_ns);
+        sent_private += other.sent_private;
+        sent_broadcast += other.sent_broadcast;
+        delivered += other.delivered;
+        disconnects += other.disconnects;
+        invalid_frames += other.invalid_frames;
+    }
+};
+
+struct Connection {
+    Client client;
+    proto::Decoder decoder{proto::Version::V1};
+    // Encoded messages which the socket didn't take yet.
+    std::vector<std::byte> unsent;
+    bool is_registered = false;
+    bool is_open = true;
+
+    Connection(const std::string& ip, unsigned short port) : client(ip, port) {}
+};
+
+[[noreturn]] void fail(std::string_view what) {
+    std::cerr << "termchat-bench: " << what << '\n';
+    std::exit(1);
+}
+
+std::string user_name(const Settings& settings, std::size_t index) {
+    return settings.prefix + '-' + std::to_string(index);
+}
+
+// Messages carry the time they were meant to be sent at, so that the latency is measured from
+// then: if the server, or the bench, falls behind, the wait counts too.
+constexpr char time_marker = '@';
+
+void write_message(
+    std::string_view to, Clock::time_point intended, std::size_t size, std::string& out) {
+    out.assign(to);
+    out += ' ';
+    out += time_marker;
+    out += std::to_string(intended.time_since_epoch().count());
+    out += ';';
+    const auto text_size = out.size() - to.size() - 1;
+    if (text_size < size) {
+        out.append(size - text_size, 'x');
+    }
+}
+
+std::optional<Clock::time_point> read_intended(std::string_view message) {
+    const auto pos = message.find(time_marker);
+    if (pos == std::string_view::npos) {
+        return std::nullopt;
+    }
+    Clock::rep ticks;
+    const auto end = message.data() + message.size();
+    if (std::from_chars(message.data() + pos + 1, end, ticks).ec != std::errc()) {
+        return std::nullopt;
+    }
+    return Clock::time_point(Clock::duration(ticks));
+}
+
+// Drives the clients of one thread, with indices from first on.
+class Driver {
+private:
+    const Settings& m_settings;
+    Shared& m_shared;
+    std::size_t m_first;
+    std::vector<std::unique_ptr<Connection>> m_connections;
+    ClientPoller m_poller;
+    // Connections with unsent bytes.
+    std::vector<std::size_t> m_unsent;
+    std::mt19937_64 m_random;
+    Results m_results;
+
+    void flush(std::size_t i) {
+        auto& c = *m_connections[i];
+        const auto res = c.client.try_send(c.unsent);
+        c.unsent.erase(c.unsent.begin(), c.unsent.begin() + res.bytes);
+        if (res.status == IoStatus::Closed || res.status == IoStatus::Error) {
+            close(c);
+        } else if (!c.unsent.empty() &&
+                   std::find(m_unsent.begin(), m_unsent.end(), i) == m_unsent.end()) {
+            m_unsent.push_back(i);
+        }
+    }
+
+    void send(std::size_t i, std::string_view message) {
+        auto& c = *m_connections[i];
+        if (!c.is_open) {
+            return;
+        }
+        const bool was_empty = c.unsent.empty();
+        proto::pack(message, c.unsent);
+        if (was_empty) {
+            flush(i);
+        }
+    }
+
+    void close(Connection& c) {
+        if (c.is_open) {
+            c.is_open = false;
+            ++m_results.disconnects;
+            c.client.close();
+        }
+    }
+
+    void on_message(Connection& c, std::string_view message, Clock::time_point now) {
+        if (!c.is_registered) {
+            if (message.find("Happy chatting!") != std::string_view::npos) {
+                c.is_registered = true;
+                m_shared.registered.fetch_add(1, std::memory_order_relaxed);
+            } else if (message.find("Try again!") != std::string_view::npos) {
+                fail("a user name was refused, try another --prefix");
+            }
+            return;
+        }
+
+        const auto intended = read_intended(message);
+        if (!intended.has_value() || !m_shared.is_scheduled.load(std::memory_order_acquire)) {
+            return;
+        }
+        const auto& schedule = m_shared.schedule;
+        if (*intended >= schedule.measure_from && *intended < schedule.measure_until) {
+            ++m_results.delivered;
+            m_results.latency_ns.record(
+                std::chrono::duration_cast<std::chrono::nanoseconds>(now - *intended).count());
+        }
+    }
+
+    void receive(std::size_t i) {
+        auto& c = *m_connections[i];
+        if (!c.is_open) {
+            return;
+        }
+        const auto received = c.client.try_recv(c.decoder.buffer());
+        const auto now = Clock::now();
+
+        for (;;) {
+            const auto res = c.decoder.next();
+            if (res.status == proto::Decoder::Status::Incomplete) {
+                break;
+            } else if (res.status == proto::Decoder::Status::Invalid) {
+                ++m_results.invalid_frames;
+            } else if (res.status == proto::Decoder::Status::Disconnect) {
+                close(c);
+                return;
+            } else if (res.status == proto::Decoder::Status::Message) {
+                on_message(c, res.message, now);
+            }
+        }
+        if (received.status == IoStatus::Closed || received.status == IoStatus::Error) {
+            close(c);
+        }
+    }
+
+    // Handles what the server sent, waiting for at most the given time for it.
+    void receive_ready(std::chrono::milliseconds timeout, std::vector<std::size_t>& ready) {
+        auto unsent = std::exchange(m_unsent, {});
+        for (auto i : unsent) {
+            flush(i);
+        }
+
+        m_poller.wait(ready, timeout);
+        for (auto i : ready) {
+            receive(i);
+        }
+    }
+
+public:
+    Driver(const Settings& settings, Shared& shared, std::size_t first, std::size_t count,
+           std::uint64_t seed)
+        : m_settings(settings), m_shared(shared), m_first(first), m_random(seed) {
+        for (std::size_t i = 0; i < count; ++i) {
+            m_connections.push_back(std::make_unique<Connection>(settings.ip, settings.port));
+            m_poller.add(m_connections.back()->client, i);
+            send(i, user_name(settings, first + i));
+        }
+    }
+
+    Results run() {
+        std::vector<std::size_t> ready;
+        while (!m_shared.is_scheduled.load(std::memory_order_acquire)) {
+            receive_ready(std::chrono::milliseconds(10), ready);
+        }
+
+        const auto& schedule = m_shared.schedule;
+        const auto interval = std::chrono::duration_cast<Clock::duration>(
+            std::chrono::duration<double>(m_settings.threads / m_settings.rate));
+        std::bernoulli_distribution is_broadcast(m_settings.broadcast_ratio);
+        std::uniform_int_distribution<std::size_t> pick_other(0, m_settings.connections - 2);
+
+        std::string message;
+        std::size_t next_sender = 0;
+        auto next_send = schedule.send_from;
+        for (;;) {
+            const auto now = Clock::now();
+            if (now >= schedule.drain_until) {
+                break;
+            }
+
+            // Open loop: late messages are sent right away rather than skipped.
+            for (; next_send <= now && next_send < schedule.measure_until; next_send += interval) {
+                const auto from = next_sender++ % m_connections.size();
+                const bool is_measured = next_send >= schedule.measure_from;
+
+                if (is_broadcast(m_random)) {
+                    write_message("bc", next_send, m_settings.size, message);
+                    m_results.sent_broadcast += is_measured;
+                } else {
+                    // Any client but the sender.
+                    auto to = pick_other(m_random);
+                    to += to >= m_first + from;
+                    write_message(user_name(m_settings, to), next_send, m_settings.size, message);
+                    m_results.sent_private += is_measured;
+                }
+                send(from, message);
+            }
+
+            auto timeout = std::chrono::milliseconds(10);
+            if (next_send < schedule.measure_until) {
+                timeout = std::min(
+                    timeout,
+                    std::chrono::duration_cast<std::chrono::milliseconds>(next_send - now));
+            }
+            receive_ready(timeout, ready);
+        }
+        return m_results;
+    }
+};
+
+void write_json(
+    std::ostream& out, const Settings& settings, const Results& results, double setup_s) {
+    const auto& latency = results.latency_ns;
+    const auto us = [](double ns) { return ns / 1000; };
+    const auto expected =
+        results.sent_private + results.sent_broadcast * (settings.connections - 1);
+
+    std::string label;
+    for (const auto c : settings.label) {
+        if (c == '"' || c == '\\') {
+            label += '\\';
+        }
+        label += c;
+    }
+
+    out << std::fixed << std::setprecision(3);
+    out << "{\n"
+        << "  \"label\": \"" << label << "\",\n"
+        << "  \"config\": {\n"
+        << "    \"connections\": " << settings.connections << ",\n"
+        << "    \"threads\": " << settings.threads << ",\n"
+        << "    \"rate\": " << settings.rate << ",\n"
+        << "    \"broadcast_ratio\": " << settings.broadcast_ratio << ",\n"
+        << "    \"size\": " << settings.size << ",\n"
+        << "    \"warmup_s\": " << settings.warmup_s << ",\n"
+        << "    \"duration_s\": " << settings.duration_s << "\n"
+        << "  },\n"
+        << "  \"setup_s\": " << setup_s << ",\n"
+        << "  \"sent\": {\"private\": " << results.sent_private
+        << ", \"broadcast\": " << results.sent_broadcast << "},\n"
+        << "  \"deliveries\": {\"expected\": " << expected
+        << ", \"received\": " << results.delivered << "},\n"
+        << "  \"throughput\": {\"sent_per_s\": "
+        << (results.sent_private + results.sent_broadcast) / settings.duration_s
+        << ", \"delivered_per_s\": " << results.delivered / settings.duration_s << "},\n"
+        << "  \"latency_us\": {"
+        << "\"min\": " << us(latency.min()) << ", \"mean\": " << us(latency.mean())
+        << ", \"p50\": " << us(latency.percentile(50))
+        << ", \"p90\": " << us(latency.percentile(90))
+        << ", \"p99\": " << us(latency.percentile(99))
+        << ", \"p999\": " << us(latency.percentile(99.9)) << ", \"max\": " << us(latency.max())
+        << "},\n"
+        << "  \"disconnects\": " << results.disconnects << ",\n"
+        << "  \"invalid_frames\": " << results.invalid_frames << "\n"
+        << "}\n";
+}
+
+// Thousands of connections need more descriptors than the usual default limit.
+void raise_file_limit(std::size_t needed) {
+    rlimit limit;
+    if (getrlimit(RLIMIT_NOFILE, &limit) == -1) {
+        return;
+    }
+    if (limit.rlim_cur < needed && limit.rlim_cur < limit.rlim_max) {
+        limit.rlim_cur = std::min<rlim_t>(limit.rlim_max, needed);
+        setrlimit(RLIMIT_NOFILE, &limit);
+        getrlimit(RLIMIT_NOFILE, &limit);
+    }
+    if (limit.rlim_cur < needed) {
+        fail("too many connections for the limit of open files, see ulimit -n");
+    }
+}
+} // namespace
+
+int main(int argc, char** argv) try {
+    if (argc < 3) {
+        std::cerr << "termchat-bench: ip and port must be specified\n";
+        return 1;
+    }
+
+    Settings settings{.ip = argv[1], .port = static_cast<unsigned short>(std::stoul(argv[2]))};
+    for (int i = 3; i < argc; ++i) {
+        const std::string_view arg = argv[i];
+        const std::string_view value = i + 1 < argc ? argv[i + 1] : "";
+
+        if (arg == "--connections" && !value.empty()) {
+            settings.connections = std::stoul(argv[++i]);
+        } else if (arg == "--threads" && !value.empty()) {
+            settings.threads = std::stoul(argv[++i]);
+        } else if (arg == "--rate" && !value.empty()) {
+            settings.rate = std::stod(argv[++i]);
+        } else if (arg == "--broadcast-ratio" && !value.empty()) {
+            settings.broadcast_ratio = std::stod(argv[++i]);
+        } else if (arg == "--size" && !value.empty()) {
+            settings.size = std::stoul(argv[++i]);
+        } else if (arg == "--warmup" && !value.empty()) {
+            settings.warmup_s = std::stod(argv[++i]);
+        } else if (arg == "--duration" && !value.empty()) {
+            settings.duration_s = std::stod(argv[++i]);
+        } else if (arg == "--drain" && !value.empty()) {
+            settings.drain_s = std::stod(argv[++i]);
+        } else if (arg == "--prefix" && !value.empty()) {
+            settings.prefix = argv[++i];
+        } else if (arg == "--label" && !value.empty()) {
+            settings.label = argv[++i];
+        } else if (arg == "--output" && !value.empty()) {
+            settings.output = argv[++i];
+        } else {
+            std::cerr << "termchat-bench: unknown option " << arg << '\n';
+            return 1;
+        }
+    }
+
+    if (settings.connections < 2 || settings.threads == 0 ||
+        settings.threads > settings.connections || settings.rate <= 0 ||
+        settings.duration_s <= 0 || settings.size > proto::max_body_size / 2) {
+        std::cerr << "termchat-bench: invalid settings\n";
+        return 1;
+    }
+    // Descriptors for the connections, and a few for everything else.
+    raise_file_limit(settings.connections + 64);
+
+    Shared shared;
+    std::vector<Results> results(settings.threads);
+    const auto setup_start = Clock::now();
+
+    std::vector<std::jthread> threads;
+    for (std::size_t t = 0; t < settings.threads; ++t) {
+        const auto first = settings.connections * t / settings.threads;
+        const auto last = settings.connections * (t + 1) / settings.threads;
+        threads.emplace_back([&, t, first, last] {
+            try {
+                Driver driver(settings, shared, first, last - first, t + 1);
+                results[t] = driver.run();
+            } catch (const std::exception& e) {
+                fail(e.what());
+            }
+        });
+    }
+
+    // Registrations are announced to everyone, so they take a while with many clients.
+    auto last_progress = Clock::now();
+    for (std::size_t registered = 0; registered < settings.connections;) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        const auto now = shared.registered.load(std::memory_order_relaxed);
+        if (now != registered) {
+            registered = now;
+            last_progress = Clock::now();
+        } else if (Clock::now() - last_progress > std::chrono::seconds(30)) {
+            fail("clients are not getting registered");
+        }
+    }
+    const auto setup_s = std::chrono::duration<double>(Clock::now() - setup_start).count();
+
+    const auto seconds = [](double s) {
+        return std::chrono::duration_cast<Clock::duration>(std::chrono::duration<double>(s));
+    };
+    auto& schedule = shared.schedule;
+    schedule.send_from = Clock::now();
+    schedule.measure_from = schedule.send_from + seconds(settings.warmup_s);
+    schedule.measure_until = schedule.measure_from + seconds(settings.duration_s);
+    schedule.drain_until = schedule.measure_until + seconds(settings.drain_s);
+    shared.is_scheduled.store(true, std::memory_order_release);
+
+    threads.clear();
+    Results total;
+    for (const auto& r : results) {
+        total.merge(r);
+    }
+
+    if (settings.output.empty()) {
+        write_json(std::cout, settings, total, setup_s);
+    } else {
+        std::ofstream out(settings.output);
+        write_json(out, settings, total, setup_s);
+        if (!out) {
+            std::cerr << "termchat-bench: failed to write " << settings.output << '\n';
+            return 1;
+        }
+    }
+} catch (const std::exception& e) {
+    std::cerr << e.what() << '\n';
+    return 1;
+}
@@ -0,0 +1,566 @@
+#ifndef TERMCHAT_CHAT_H
+#define TERMCHAT_CHAT_H
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <memory_resource>
+#include <mutex>
+#include <optional>
+#include <span>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "protocol.h"
+#include "slotmap.h"
+#include "socket.h"
+#include "text.h"
+
+// The state of the chat and the building blocks of what the server sends, apart from the
+// threads and the event loop which drive them in server.cpp.
+
+class Username {
+public:
+    static constexpr std::size_t max_size = 30;
+
+private:
+    // Stored inline, so that copying a name never allocates.
+    std::array<char, max_size> m_chars{};
+    std::uint8_t m_size = 0;
+
+    explicit Username(std::string_view s) : m_size(s.size()) {
+        std::copy(s.begin(), s.end(), m_chars.begin());
+    }
+
+public:
+    // An empty name, which parse() never returns.
+    Username() = default;
+
+    static std::optional<Username> parse(std::string_view s) {
+        // User names should be of the form [a-z0-9-_]{3,30}.
+        if (s.size() < 3 || s.size() > max_size) {
+            return std::nullopt;
+        }
+        if (!text::is_user_name(s)) {
+            return std::nullopt;
+        }
+        // User name also can't be "bc" but that case is handled by the length check.
+        return Username(s);
+    }
+
+    operator std::string_view() const noexcept { return {m_chars.data(), m_size}; }
+};
+
+// Channels are named like users, after a '#' which is not part of the name.
+using ChannelName = Username;
+
+inline std::optional<ChannelName> parse_channel_name(std::string_view s) {
+    if (!s.starts_with('#')) {
+        return std::nullopt;
+    }
+    return Username::parse(s.substr(1));
+}
+
+// Lets string keyed tables be looked up by string_view, without building a string.
+struct StringHash {
+    using is_transparent = void;
+    std::size_t operator()(std::string_view s) const noexcept {
+        return std::hash<std::string_view>{}(s);
+    }
+};
+
+// Where a registered client lives: the shard serving it and its handle in that shard's
+// registry.
+struct Location {
+    std::size_t shard;
+    SlotHandle client;
+};
+
+// The user names of all the shards. It is the only state shared between threads, so it is
+// split into stripes, each with its own lock: registrations of different names rarely
+// contend, and a lookup only holds a lock for the duration of a hash table probe.
+class Directory {
+private:
+    static constexpr std::size_t stripe_count = 64;
+
+    using Hash = StringHash;
+
+    struct Entry {
+        Location location;
+        // Order of registration, for listing the active users.
+        std::uint64_t seq;
+    };
+
+    struct Stripe {
+        std::mutex mutex;
+        std::unordered_map<std::string, Entry, Hash, std::equal_to<>> entries;
+    };
+
+    std::array<Stripe, stripe_count> m_stripes;
+    std::atomic<std::uint64_t> m_next_seq = 0;
+
+    Stripe& stripe(std::string_view user_name) noexcept {
+        return m_stripes[Hash{}(user_name) % stripe_count];
+    }
+
+public:
+    // Returns false if the user name is taken.
+    bool claim(std::string_view user_name, Location location) {
+        auto& s = stripe(user_name);
+        std::lock_guard lock(s.mutex);
+
+        const auto seq = m_next_seq.fetch_add(1, std::memory_order_relaxed);
+        return s.entries.try_emplace(std::string(user_name), Entry{location, seq}).second;
+    }
+
+    void release(std::string_view user_name) {
+        auto& s = stripe(user_name);
+        std::lock_guard lock(s.mutex);
+
+        const auto it = s.entries.find(user_name);
+        if (it != s.entries.end()) {
+            s.entries.erase(it);
+        }
+    }
+
+    std::optional<Location> find(std::string_view user_name) {
+        auto& s = stripe(user_name);
+        std::lock_guard lock(s.mutex);
+
+        const auto it = s.entries.find(user_name);
+        if (it == s.entries.end()) {
+            return std::nullopt;
+        }
+        return it->second.location;
+    }
+
+    // Returns the user names in the order they were registered, allocated from memory.
+    std::pmr::vector<std::pmr::string> user_names(std::pmr::memory_resource* memory) {
+        std::pmr::vector<std::pair<std::uint64_t, std::pmr::string>> all(memory);
+        for (auto& s : m_stripes) {
+            std::lock_guard lock(s.mutex);
+            for (const auto& [user_name, entry] : s.entries) {
+                all.emplace_back(entry.seq, std::string_view(user_name));
+            }
+        }
+        std::sort(all.begin(), all.end());
+
+        std::pmr::vector<std::pmr::string> user_names(memory);
+        user_names.reserve(all.size());
+        for (auto& [seq, user_name] : all) {
+            user_names.push_back(std::move(user_name));
+        }
+        return user_names;
+    }
+};
+
+// A message in each encoding of the protocol, so that every recipient gets it the way it
+// speaks without rendering or compressing it again. All share a single allocation.
+struct Encoded {
+    Frame v1;
+    Frame v2;
+    // The same as v2 if the message was not worth compressing.
+    Frame v2_compressed;
+
+    const Frame& in(const proto::Encoding& encoding) const noexcept {
+        if (encoding.version == proto::Version::V1) {
+            return v1;
+        }
+        return encoding.is_compressed ? v2_compressed : v2;
+    }
+};
+
+// Encodes a body too long for a frame as a series of frames, all but the last chunks, each
+// compressed on its own. Version 1 has no chunks, but its clients show the pieces one after
+// the other just the same.
+inline Encoded encode_in_pieces(
+    std::span<const std::byte> body, bool should_compress, proto::FrameType type) {
+    // Reused by the thread: v1, v2 and compressed v2, one after the other.
+    thread_local std::vector<std::byte> out;
+    thread_local std::vector<std::byte> compressed;
+    out.clear();
+    std::array<std::size_t, 3> sizes{};
+    bool is_compressed = false;
+
+    const auto append = [&](std::size_t encoding, proto::FrameType piece_type,
+                            std::span<const std::byte> piece, bool is_piece_compressed = false) {
+        std::array<std::byte, proto::max_header_size> header;
+        const auto header_size = proto::write_header(
+            encoding == 0 ? proto::Version::V1 : proto::Version::V2, piece_type, piece.size(),
+            header, is_piece_compressed);
+        // Each encoding is built in turn, so this is the end of the current one.
+        out.insert(out.end(), header.begin(), header.begin() + header_size);
+        out.insert(out.end(), piece.begin(), piece.end());
+        sizes[encoding] += header_size + piece.size();
+    };
+
+    for (std::size_t encoding = 0; encoding < (should_compress ? 3 : 2); ++encoding) {
+        for (auto rest = body; !rest.empty();) {
+            const auto size = proto::first_piece_size(
+                std::string_view(reinterpret_cast<const char*>(rest.data()), rest.size()));
+            const auto piece = rest.first(size);
+            rest = rest.subspan(size);
+            const auto piece_type = rest.empty() ? type : proto::FrameType::Chunk;
+
+            compressed.clear();
+            if (encoding == 2 && should_compress && piece.size() >= proto::min_compress_size &&
+                proto::compress(piece, compressed)) {
+                is_compressed = true;
+                append(encoding, piece_type, compressed, true);
+            } else {
+                append(encoding, piece_type, piece);
+            }
+        }
+    }
+
+    const Frame all(out);
+    const auto v2 = all.slice(sizes[0], sizes[1]);
+    return {
+        .v1 = all.slice(0, sizes[0]),
+        .v2 = v2,
+        .v2_compressed = is_compressed ? all.slice(sizes[0] + sizes[1], sizes[2]) : v2,
+    };
+}
+
+// Longer bodies are encoded in pieces, see encode_in_pieces().
+inline Encoded encode(
+    std::span<const std::byte> body, bool should_compress,
+    proto::FrameType type = proto::FrameType::Data) {
+    if (body.size() > proto::max_body_size) {
+        return encode_in_pieces(body, should_compress, type);
+    }
+    std::array<std::byte, proto::max_header_size> v1_header;
+    std::array<std::byte, proto::max_header_size> v2_header;
+    const auto v1_header_size =
+        proto::write_header(proto::Version::V1, type, body.size(), v1_header);
+    const auto v2_header_size =
+        proto::write_header(proto::Version::V2, type, body.size(), v2_header);
+
+    // Reused by the thread, as buf still holds the body.
+    thread_local std::vector<std::byte> compressed;
+    compressed.clear();
+    const bool is_compressed = should_compress && body.size() >= proto::min_compress_size &&
+                               proto::compress(body, compressed);
+    std::array<std::byte, proto::max_header_size> compressed_header;
+    const auto compressed_header_size =
+        is_compressed ? proto::write_header(
+                            proto::Version::V2, type, compressed.size(), compressed_header, true)
+                      : 0;
+
+    const Frame all{
+        std::span<const std::byte>(v1_header).first(v1_header_size), body,
+        std::span<const std::byte>(v2_header).first(v2_header_size), body,
+        std::span<const std::byte>(compressed_header).first(compressed_header_size),
+        compressed};
+    const auto v1_size = v1_header_size + body.size();
+    const auto v2_size = v2_header_size + body.size();
+    const auto v2 = all.slice(v1_size, v2_size);
+    return {
+        .v1 = all.slice(0, v1_size),
+        .v2 = v2,
+        .v2_compressed =
+            is_compressed
+                ? all.slice(v1_size + v2_size, compressed_header_size + compressed.size())
+                : v2,
+    };
+}
+
+inline Encoded encode(std::string_view msg) {
+    return encode(std::as_bytes(std::span(msg)), true);
+}
+
+// A hello is not a frame: it is sent as is, whatever the encoding.
+inline Encoded encode_hello(proto::Encoding encoding) {
+    const Frame hello(proto::hello(encoding));
+    return {.v1 = hello, .v2 = hello, .v2_compressed = hello};
+}
+
+// Text a client sent, to be shown to others: indented, and rid of what could mess with their
+// terminals.
+class indent {
+private:
+    std::string_view s;
+
+public:
+    explicit indent(std::string_view s) : s(s) {}
+    friend proto::Writer& operator<<(proto::Writer& out, const indent& i) {
+        const auto dest = out.extend(text::indented_size(i.s));
+        text::write_indented(i.s, reinterpret_cast<char*>(dest.data()));
+        return out;
+    }
+};
+
+// Everything a shard knows about one of its clients.
+struct ClientRecord {
+    ServerClient client;
+    // Set once the client is registered.
+    std::optional<Username> user_name;
+    proto::Decoder decoder;
+    // How the client is sent messages.
+    proto::Encoding encoding;
+    // When the client last sent something, and the timer which checks on it, both in the
+    // terms of the shard's timer wheel.
+    std::uint64_t heard_at = 0;
+    SlotHandle timer;
+
+    struct Membership {
+        ChannelName channel;
+        // Of the client among the members of the channel on this shard.
+        std::uint32_t index;
+    };
+    // The channels the client is in, in no particular order.
+    std::vector<Membership> channels;
+
+    // Where the message the client is sending in chunks goes, as its first piece said, so
+    // that the other pieces are passed on as they come without holding on to any of them.
+    struct Stream {
+        enum class To {
+            Everyone,
+            User,
+            Channel,
+            // The first piece was rejected, and so is the rest.
+            Nowhere,
+        };
+        To to = To::Nowhere;
+        Location user{};
+        ChannelName channel;
+    };
+    // Set from the first piece of such a message to its last.
+    std::optional<Stream> stream;
+};
+
+// The clients of a single shard.
+class Registry {
+public:
+    using Handle = SlotHandle;
+
+private:
+    // INVARIANTS:
+    // 1. The tag of each client is the handle of its record.
+    // 2. The user name of each registered client is claimed in the directory for this shard
+    // and the client's handle.
+    // 3. Unregistered clients have nothing in the directory.
+    // 4. Each membership of a client is the position of its handle in the members of the
+    // channel, and channels without members on this shard have no entry.
+    //
+    // Records are looked up by handle in constant time, but they move when other clients are
+    // added or removed: hold on to handles rather than to records.
+
+    Directory& m_directory;
+    std::size_t m_shard;
+    SlotMap<ClientRecord> m_records;
+    // The members of each channel, packed so that sending to a channel walks them only.
+    std::unordered_map<std::string, std::vector<Handle>, StringHash, std::equal_to<>> m_channels;
+
+    static ClientRecord::Membership* membership(ClientRecord& record, std::string_view channel) {
+        for (auto& membership : record.channels) {
+            if (std::string_view(membership.channel) == channel) {
+                return &membership;
+            }
+        }
+        return nullptr;
+    }
+
+    // Forgets the member at the given position, moving the last member in its place.
+    void remove_member(std::string_view channel, std::uint32_t index) {
+        const auto it = m_channels.find(channel);
+        auto& members = it->second;
+        const auto moved = members.back();
+        members[index] = moved;
+        members.pop_back();
+
+        if (index < members.size()) {
+            membership(*find(moved), channel)->index = index;
+        } else if (members.empty()) {
+            m_channels.erase(it);
+        }
+    }
+
+public:
+    Registry(Directory& directory, std::size_t shard) : m_directory(directory), m_shard(shard) {}
+
+    static Handle handle_of(const ServerClient& client) noexcept {
+        return Handle::from_bits(client.tag());
+    }
+
+    Handle add_unregistered(ServerClient client) {
+        if (contains(handle_of(client))) {
+            throw std::logic_error("tried to add already added client");
+        }
+
+        const auto handle = m_records.insert(ClientRecord{.client = std::move(client)});
+        m_records.find(handle)->client.set_tag(handle.bits());
+        return handle;
+    }
+
+    // Returns null if the client was removed.
+    ClientRecord* find(Handle handle) noexcept { return m_records.find(handle); }
+
+    bool contains(Handle handle) noexcept { return m_records.contains(handle); }
+
+    bool is_registered(Handle handle) noexcept {
+        const auto record = find(handle);
+        return record != nullptr && record->user_name.has_value();
+    }
+
+    std::optional<std::reference_wrapper<Username>> get_user_name(Handle handle) noexcept {
+        const auto record = find(handle);
+        if (record == nullptr || !record->user_name.has_value()) {
+            return std::nullopt;
+        }
+        return *record->user_name;
+    }
+
+    // Finds a registered client of any shard.
+    std::optional<Location> locate(const Username& user_name) {
+        return m_directory.find(user_name);
+    }
+
+    bool register_client(Handle handle, Username user_name) {
+        const auto record = find(handle);
+        if (record == nullptr || record->user_name.has_value()) {
+            throw std::logic_error("tried to register inexistent or already registered client");
+        }
+
+        if (!m_directory.claim(user_name, {.shard = m_shard, .client = handle})) {
+            return false;
+        }
+
+        record->user_name = std::move(user_name);
+
+        return true;
+    }
+
+    void remove(Handle handle) {
+        const auto record = find(handle);
+        if (record == nullptr) {
+            throw std::logic_error("tried to remove inexistent client");
+        }
+
+        if (record->user_name.has_value()) {
+            m_directory.release(*record->user_name);
+        }
+        for (const auto& membership : record->channels) {
+            remove_member(membership.channel, membership.index);
+        }
+        m_records.erase(handle);
+    }
+
+    // Channels a client can be in at once, which bounds the work of removing it.
+    static constexpr std::size_t max_channels = 32;
+
+    bool is_member(Handle handle, std::string_view channel) noexcept {
+        const auto record = find(handle);
+        return record != nullptr && membership(*record, channel) != nullptr;
+    }
+
+    // Returns false if the client is in the channel already, or in max_channels of them.
+    bool join(Handle handle, const ChannelName& channel) {
+        const auto record = find(handle);
+        if (record == nullptr || !record->user_name.has_value()) {
+            throw std::logic_error("tried to add inexistent or unregistered client to channel");
+        }
+        if (record->channels.size() >= max_channels || membership(*record, channel) != nullptr) {
+            return false;
+        }
+
+        auto it = m_channels.find(std::string_view(channel));
+        if (it == m_channels.end()) {
+            it = m_channels.try_emplace(std::string(std::string_view(channel))).first;
+        }
+        auto& members = it->second;
+        record->channels.push_back({.channel = channel, .index = std::uint32_t(members.size())});
+        members.push_back(handle);
+        return true;
+    }
+
+    // Returns false if the client is not in the channel.
+    bool leave(Handle handle, std::string_view channel) {
+        const auto record = find(handle);
+        const auto found = record != nullptr ? membership(*record, channel) : nullptr;
+        if (found == nullptr) {
+            return false;
+        }
+
+        remove_member(channel, found->index);
+        // The record is not moved by that, only the memberships of other clients are touched.
+        *found = record->channels.back();
+        record->channels.pop_back();
+        return true;
+    }
+
+    // How many clients of this shard are in the channel.
+    std::size_t member_count(std::string_view channel) const noexcept {
+        const auto it = m_channels.find(channel);
+        return it == m_channels.end() ? 0 : it->second.size();
+    }
+
+    struct Sent {
+        std::size_t messages = 0;
+        std::size_t bytes = 0;
+    };
+
+private:
+    static void send(
+        Handle handle, ClientRecord& record, const Encoded& frame, Sent& sent,
+        std::pmr::vector<Handle>& failed) {
+        const auto& bytes = frame.in(record.encoding);
+        if (record.client.try_send(bytes).ok()) {
+            ++sent.messages;
+            sent.bytes += bytes.size();
+        } else {
+            failed.push_back(handle);
+        }
+    }
+
+public:
+
+    // Sends the frame, in their encoding, to the registered clients but omit. Those whose
+    // send failed are appended to failed: removing them is up to the caller.
+    Sent send_to_registered_except(
+        std::optional<Handle> omit, const Encoded& frame, std::pmr::vector<Handle>& failed) {
+        const auto records = m_records.values();
+        const auto handles = m_records.handles();
+
+        Sent sent;
+        for (std::size_t i = 0; i < records.size(); ++i) {
+            if (handles[i] == omit || !records[i].user_name.has_value()) {
+                continue;
+            }
+
+            send(handles[i], records[i], frame, sent, failed);
+        }
+        return sent;
+    }
+
+    // The same, to the members of the channel on this shard only: the others are not looked
+    // at.
+    Sent send_to_channel_except(
+        std::string_view channel, std::optional<Handle> omit, const Encoded& frame,
+        std::pmr::vector<Handle>& failed) {
+        Sent sent;
+        const auto it = m_channels.find(channel);
+        if (it == m_channels.end()) {
+            return sent;
+        }
+        for (const auto handle : it->second) {
+            if (handle != omit) {
+                send(handle, *m_records.find(handle), frame, sent, failed);
+            }
+        }
+        return sent;
+    }
+
+    // In the same order.
+    std::span<ClientRecord> records() noexcept { return m_records.values(); }
+    std::span<const Handle> handles() const noexcept { return m_records.handles(); }
+};
+
+#endif // TERMCHAT_CHAT_H
@@ -1,15 +1,55 @@
 #include <atomic>
+#include <chrono>
+#include <condition_variable>
 #include <cstddef>
 #include <exception>
 #include <future>
 #include <iostream>
+#include <mutex>
+#include <optional>
 #include <string>
+#include <string_view>
 #include <vector>
 
 #include "protocol.h"
 #include "receive.h"
 #include "socket.h"
 
+// The version the client speaks, decided once, by whichever comes first: the server's answer
+// to the hello, or the sender giving up on it. Both directions follow that decision.
+class Negotiation {
+private:
+    std::mutex m_mutex;
+    std::condition_variable m_decided;
+    std::optional<proto::Version> m_version;
+
+public:
+    // Returns false, leaving the decision alone, if it was already made.
+    bool decide(proto::Version version) {
+        {
+            const std::lock_guard lock(m_mutex);
+            if (m_version.has_value()) {
+                return false;
+            }
+            m_version = version;
+        }
+        m_decided.notify_all();
+        return true;
+    }
+
+    // Returns false if nothing was decided within the timeout.
+    bool wait_for(std::chrono::milliseconds timeout) {
+        std::unique_lock lock(m_mutex);
+        return m_decided.wait_for(lock, timeout, [&] { return m_version.has_value(); });
+    }
+
+    // Only meaningful once decided.
+    proto::Version version() {
+        const std::lock_guard lock(m_mutex);
+        return m_version.value_or(proto::Version::V1);
+    }
+};
+
 int main(int argc, char** argv) try {
     if (argc < 3) {
         std::cerr << "termchat: ip and port must be specified\n";
@@ -18,16 +58,55 @@ int main(int argc, char** argv) try {
 
     const unsigned short port = std::stoul(argv[2]);
 
+    // Compression saves bandwidth on slow links, at some CPU cost on both sides.
+    bool should_compress = false;
+    for (int i = 3; i < argc; ++i) {
+        if (std::string_view(argv[i]) == "--compress") {
+            should_compress = true;
+        } else {
+            std::cerr << "termchat: unknown option " << argv[i] << '\n';
+            return 1;
+        }
+    }
+
     Client client(argv[1], port);
     std::atomic_flag is_server_closed;
 
+    // Nothing else is sent until the server answers with what it picked, or until it is clear
+    // that it won't: a server which only speaks version 1 doesn't know about hellos.
+    client.send(proto::hello({.version = proto::latest_version, .is_compressed = should_compress}));
+    Negotiation negotiation;
+    constexpr std::chrono::seconds hello_timeout(3);
+
     const auto send_done = std::async(std::launch::async, [&]() {
+        if (!negotiation.wait_for(hello_timeout) && negotiation.decide(proto::Version::V1)) {
+            // Such a server took the hello for the start of a version 1 header. Completing
+            // the header, which is not valid, gets what follows read from its start.
+            const std::vector<std::byte> padding(proto::header_size - proto::hello_size);
+            try {
+                client.send(padding);
+            } catch (const SocketError&) {
+            }
+        }
+        const auto version = negotiation.version();
+
         std::vector<std::byte> buf;
         for (std::string s; std::getline(std::cin, s);) {
-            buf.resize(0);
-            proto::pack(s, buf);
             try {
-                client.send(buf);
+                // Lines too long for a frame are sent in chunks, which version 1 doesn't have.
+                std::string_view rest = s;
+                while (version != proto::Version::V1 && rest.size() > proto::max_body_size) {
+                    const auto size = proto::first_piece_size(rest);
+                    buf.clear();
+                    proto::Writer out(buf);
+                    out << rest.substr(0, size);
+                    client.send(out.finish(version, proto::FrameType::Chunk));
+                    rest.remove_prefix(size);
+                }
+                buf.clear();
+                proto::Writer out(buf);
+                out << rest;
+                client.send(out.finish(version));
             } catch (const SocketError&) {
                 try {
                     client.close();
@@ -36,10 +115,9 @@ int main(int argc, char** argv) try {
             }
         }
         if (!is_server_closed.test()) {
-            buf.resize(0);
-            proto::pack("", buf); // disconnect message is empty string
+            buf.clear();
             try {
-                client.send(buf);
+                client.send(proto::Writer(buf).finish(version, proto::FrameType::Disconnect));
             } catch (const SocketError&) {
             }
             try {
@@ -49,13 +127,29 @@ int main(int argc, char** argv) try {
         }
     });
 
+    auto version = proto::Version::V1;
     try {
         for (std::vector<std::byte> buf;;) {
-            const auto recv = receive(client, buf);
+            const auto recv = receive(client, buf, version);
             if (!recv.is_connected) {
                 std::cout << "Server closed. Please quit the program.\n";
                 break;
             }
+            if (recv.encoding.has_value()) {
+                if (!negotiation.decide(recv.encoding->version)) {
+                    // The sender gave up waiting and went on in version 1, which the server,
+                    // having switched to what it answered, can't make sense of anymore.
+                    std::cout << "The server answered too late. Please quit the program and "
+                                 "connect again.\n";
+                    try {
+                        client.close();
+                    } catch (const SocketError&) {
+                    }
+                    break;
+                }
+                version = recv.encoding->version;
+                continue;
+            }
             if (!recv.message.has_value()) {
                 // this would be an invalid message from the server.
                 // should not happen, so ignore.
@@ -71,6 +165,8 @@ int main(int argc, char** argv) try {
         }
     }
 
+    // Lets the sending thread notice that the connection is gone, if it is still waiting.
+    (void)negotiation.decide(version);
     send_done.wait();
 
     std::cout << "Goodbye!\n";
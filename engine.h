@@ -0,0 +1,172 @@
+#ifndef TERMCHAT_ENGINE_H
+#define TERMCHAT_ENGINE_H
+
+#include <cerrno>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <span>
+#include <vector>
+
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+#include "socket.h"
+
+// Internal to the socket library. An engine is what actually moves the bytes of a Server
+// and of its ServerClients: the readiness-based one lives in socket.cpp, the io_uring one
+// in uring.cpp. Server and ServerClient only forward to it.
+
+class Engine;
+
+// Turns the errno of a failed send or recv into a result.
+inline IoResult io_failure(int error, std::size_t bytes = 0) noexcept {
+    const bool is_reset = error == EPIPE || error == ECONNRESET;
+    return {
+        .status = is_reset ? IoStatus::Closed : IoStatus::Error, .bytes = bytes, .error = error};
+}
+
+// Sends are gathered per client and per loop iteration already, so holding back the end of
+// one until the previous one is acknowledged, as Nagle's algorithm does, only delays it, by
+// up to the peer's delayed acknowledgement timeout.
+inline void disable_nagle(int fd) noexcept {
+    const int yes = 1;
+    (void)setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &yes, sizeof yes);
+}
+
+// A descriptor which becomes readable when notify() is called, from any thread.
+class Notifier {
+private:
+    int m_read_fd;
+    int m_write_fd;
+
+public:
+    Notifier();
+    Notifier(const Notifier&) = delete;
+    Notifier& operator=(const Notifier&) = delete;
+
+    int fd() const noexcept { return m_read_fd; }
+    void notify() noexcept;
+    // Makes the descriptor not readable until the next notify().
+    void drain() noexcept;
+
+    ~Notifier();
+};
+
+// Upper bound of the messages written with a single system call.
+constexpr std::size_t max_gather = 64;
+
+// Tells the kernel that more is about to be written, when a queue takes more than one
+// write, so that it fills whole packets instead of sending the end of each write apart.
+#ifdef MSG_MORE
+constexpr int more_flag = MSG_MORE;
+#else
+constexpr int more_flag = 0;
+#endif
+
+// Messages waiting to be written to a client, oldest first.
+class OutboundQueue {
+private:
+    std::deque<Frame> m_messages;
+    // Bytes of the oldest message already written.
+    std::size_t m_written = 0;
+    // Bytes not yet written, across all messages.
+    std::size_t m_bytes = 0;
+    // Number of the oldest messages the last gather() pointed to, which a send may still be
+    // reading from until consume() is called.
+    std::size_t m_pinned = 0;
+
+public:
+    // Queues the message, applying the slow client policy if the queue is over the limit.
+    // Returns false if the client should be disconnected, in which case nothing is queued.
+    // The oldest message is never dropped, as it may be partially written, and neither are
+    // those a send in flight points to.
+    bool push(Frame, const ServerOptions&);
+
+    bool empty() const noexcept { return m_messages.empty(); }
+    // Points the given vectors to what is not yet written of the oldest messages, so that
+    // they can be written at once. Returns the number of vectors filled. Those messages are
+    // not dropped until the next call to consume().
+    std::size_t gather(std::span<iovec>) noexcept;
+    // Marks the given number of bytes as written, which may span multiple messages.
+    void consume(std::size_t n) noexcept;
+
+    ServerClient::QueueStats stats() const noexcept {
+        return {.messages = m_messages.size(), .bytes = m_bytes};
+    }
+};
+
+struct ServerClient::Private : std::enable_shared_from_this<ServerClient::Private> {
+    int fd;
+    ServerClient::ID id;
+    sockaddr_storage addr;
+    // Keeps the engine alive for as long as any of its clients is.
+    std::shared_ptr<Engine> engine;
+    // Per-connection state of the engine, if it needs any.
+    void* conn;
+
+    OutboundQueue out;
+    // Whether receiving was stopped because of SlowClientPolicy::PauseReading.
+    bool is_paused = false;
+    // Whether the poll engine waits for the client to become writable.
+    bool wants_write = false;
+    // Whether the poll engine has the client in its list of clients to write to.
+    bool is_unflushed = false;
+    // Whether the socket is in blocking mode. Clients are accepted non-blocking.
+    bool is_blocking = false;
+    // The errno of a failure noticed outside of a call on the ServerClient, if any.
+    int error = 0;
+    // See ServerClient::tag().
+    std::uint64_t tag = 0;
+
+    Private(
+        int fd, ServerClient::ID id, const sockaddr_storage& addr, std::shared_ptr<Engine> engine,
+        void* conn = nullptr)
+        : fd(fd), id(id), addr(addr), engine(std::move(engine)), conn(conn) {}
+    // Closes the connection when the last ServerClient referring to it is gone, unless it was
+    // closed explicitly.
+    ~Private();
+};
+
+class Engine : public std::enable_shared_from_this<Engine> {
+protected:
+    // ServerClient::Private is only accessible to its friends, which the engines
+    // deriving from this class are not.
+    using ClientState = ServerClient::Private;
+
+    static ServerClient make_client(std::shared_ptr<ClientState> p) {
+        return ServerClient(std::move(p));
+    }
+
+    // Pauses or resumes receiving from the client after its queue changed, if the policy
+    // is SlowClientPolicy::PauseReading. Returns true if receiving was resumed.
+    static bool update_paused(ClientState&, const ServerOptions&) noexcept;
+
+public:
+    virtual ServerEngine kind() const noexcept = 0;
+
+    // See the documentation of the Server and ServerClient methods with the same name.
+    virtual void poll(std::vector<ServerPollResult>&, std::chrono::milliseconds timeout) = 0;
+    virtual void wake() noexcept = 0;
+    virtual void shutdown() = 0;
+
+    virtual IoResult try_send(ServerClient::Private&, Frame) = 0;
+    virtual bool recv(ServerClient::Private&, std::vector<std::byte>&) = 0;
+    virtual IoResult try_recv(ServerClient::Private&, std::vector<std::byte>&) = 0;
+    virtual void set_blocking(ServerClient::Private&, bool should_block) = 0;
+    virtual void close(ServerClient::Private&) = 0;
+
+    virtual ~Engine() = default;
+};
+
+// Both take ownership of the given listening socket.
+std::shared_ptr<Engine> make_poll_engine(int listen_fd, const ServerOptions&);
+// Returns null if the running kernel doesn't support the features the engine relies on,
+// in which case the listening socket is left untouched.
+std::shared_ptr<Engine> make_uring_engine(int listen_fd, const ServerOptions&);
+
+#endif // TERMCHAT_ENGINE_H
@@ -0,0 +1,370 @@
+#ifndef TERMCHAT_HISTORY_H
+#define TERMCHAT_HISTORY_H
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <charconv>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <filesystem>
+#include <iostream>
+#include <memory>
+#include <memory_resource>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <span>
+#include <system_error>
+#include <utility>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "chat.h"
+#include "mailbox.h"
+
+// The latest broadcasts, kept in an append-only log on disk so that users who join, or come
+// back, can catch up with the conversation. The log is a series of segment files of a fixed
+// size, mapped in memory: a message is appended by copying its encodings into the mapping,
+// and replayed as frames pointing into it, so it is neither copied back nor encoded again.
+// Appending is left to a thread of its own, the threads rendering messages only posting them.
+class History {
+public:
+    struct Options {
+        // The log is bounded by the size of its segments on disk, keeping at least one.
+        std::size_t max_size = 64 << 20;
+        // Messages older than this are neither replayed nor kept, unless it is zero.
+        std::chrono::seconds max_age{0};
+        // How many of the latest messages are replayed to a user who registers.
+        std::size_t replay_count = 20;
+    };
+
+    static constexpr std::size_t segment_size = 4 << 20;
+
+private:
+    // Starts each segment, so that other files are never taken for one.
+    static constexpr std::array<char, 8> magic = {'T', 'C', 'H', 'T', 'L', 'O', 'G', '1'};
+    // Records start on multiples of this.
+    static constexpr std::size_t alignment = 8;
+
+    struct RecordHeader {
+        // Of the whole record, header and padding included. Zero past the last record.
+        std::uint32_t size;
+        std::uint32_t v1_size;
+        std::uint32_t v2_size;
+        // Zero if the message was not compressed, in which case v2 stands in for it.
+        std::uint32_t v2_compressed_size;
+        // When the message was sent, in milliseconds since the Unix epoch.
+        std::int64_t time;
+    };
+
+    struct Segment {
+        std::filesystem::path path;
+        // Unmapped once the segment is dropped and no frame points into it anymore.
+        std::shared_ptr<std::byte[]> bytes;
+        // Where the next record goes.
+        std::size_t size = magic.size();
+        // When the latest message in it was sent.
+        std::int64_t last_time = 0;
+    };
+
+    struct Entry {
+        Encoded frame;
+        std::int64_t time;
+    };
+
+    std::filesystem::path m_dir;
+    Options m_options;
+    // Oldest first, the last one being appended to. Only used by the writer once it runs.
+    std::deque<Segment> m_segments;
+    std::uint64_t m_next_segment = 0;
+
+    Mailbox<Entry> m_posted;
+    std::atomic<bool> m_has_posts = false;
+    // Whether the last message couldn't be written, so that a failure is reported once rather
+    // than for each message while it lasts.
+    bool m_is_failing = false;
+
+    // The latest messages, up to replay_count of them. Entries keep their segment mapped, even
+    // once it is dropped from the log.
+    std::mutex m_mutex;
+    std::deque<Entry> m_index;
+
+    static std::int64_t now() noexcept {
+        return std::chrono::duration_cast<std::chrono::milliseconds>(
+                   std::chrono::system_clock::now().time_since_epoch())
+            .count();
+    }
+
+    static std::size_t aligned(std::size_t size) noexcept {
+        return (size + alignment - 1) / alignment * alignment;
+    }
+
+    [[noreturn]] static void fail(const char* what, const std::filesystem::path& path) {
+        throw std::system_error(errno, std::generic_category(), what + (" " + path.string()));
+    }
+
+    // Gives the new file the size of a segment, with its blocks allocated: writing to a hole
+    // through the mapping would raise SIGBUS if the disk was full by then. Returns an errno
+    // value, or zero.
+    static int allocate(int fd) noexcept {
+#ifdef __APPLE__
+        fstore_t store{
+            .fst_flags = F_ALLOCATEALL,
+            .fst_posmode = F_PEOFPOSMODE,
+            .fst_offset = 0,
+            .fst_length = segment_size,
+        };
+        if (fcntl(fd, F_PREALLOCATE, &store) == -1 || ftruncate(fd, segment_size) == -1) {
+            return errno;
+        }
+        return 0;
+#else
+        return posix_fallocate(fd, 0, segment_size);
+#endif
+    }
+
+    // Maps a segment file, creating it if asked to. Returns nothing if an existing file is not
+    // of the size of a segment. A file which couldn't be created whole is removed.
+    static std::shared_ptr<std::byte[]> map(const std::filesystem::path& path, bool create) {
+        const int fd =
+            ::open(path.c_str(), O_RDWR | O_CLOEXEC | (create ? O_CREAT | O_EXCL : 0), 0644);
+        if (fd == -1) {
+            fail("open", path);
+        }
+        const auto close_and_fail = [&](const char* what, int error) {
+            ::close(fd);
+            if (create) {
+                std::error_code ignored;
+                std::filesystem::remove(path, ignored);
+            }
+            errno = error;
+            fail(what, path);
+        };
+
+        struct stat st {};
+        if (create) {
+            if (const auto error = allocate(fd); error != 0) {
+                close_and_fail("fallocate", error);
+            }
+        } else if (fstat(fd, &st) == -1) {
+            close_and_fail("fstat", errno);
+        }
+        if (!create && std::size_t(st.st_size) != segment_size) {
+            ::close(fd);
+            return nullptr;
+        }
+
+        const auto p = mmap(nullptr, segment_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        if (p == MAP_FAILED) {
+            close_and_fail("mmap", errno);
+        }
+        ::close(fd);
+        return std::shared_ptr<std::byte[]>(
+            static_cast<std::byte*>(p), [](std::byte* p) { munmap(p, segment_size); });
+    }
+
+    // Returns the header of the record at the given offset, or nothing past the last one.
+    static std::optional<RecordHeader> record_at(const Segment& segment, std::size_t offset) {
+        if (offset + sizeof(RecordHeader) > segment_size) {
+            return std::nullopt;
+        }
+        RecordHeader header;
+        std::memcpy(&header, segment.bytes.get() + offset, sizeof header);
+        const std::size_t payload =
+            std::size_t(header.v1_size) + header.v2_size + header.v2_compressed_size;
+        if (header.size == 0 || header.size != aligned(sizeof header + payload) ||
+            header.size > segment_size - offset) {
+            return std::nullopt;
+        }
+        return header;
+    }
+
+    static Entry entry_at(const Segment& segment, std::size_t offset, const RecordHeader& header) {
+        auto at = offset + sizeof header;
+        const auto frame = [&](std::size_t size) {
+            const Frame f(
+                std::shared_ptr<const std::byte[]>(segment.bytes, segment.bytes.get() + at), size);
+            at += size;
+            return f;
+        };
+
+        Entry entry{.time = header.time};
+        entry.frame.v1 = frame(header.v1_size);
+        entry.frame.v2 = frame(header.v2_size);
+        entry.frame.v2_compressed =
+            header.v2_compressed_size == 0 ? entry.frame.v2 : frame(header.v2_compressed_size);
+        return entry;
+    }
+
+    void index(Entry entry) {
+        const std::lock_guard lock(m_mutex);
+        m_index.push_back(std::move(entry));
+        while (m_index.size() > m_options.replay_count) {
+            m_index.pop_front();
+        }
+    }
+
+    void start_segment() {
+        // Zero padded, so that the segments sort by name too.
+        const auto number = std::to_string(m_next_segment++);
+        const auto path = m_dir / (std::string(20 - number.size(), '0') + number + ".log");
+
+        Segment segment{.path = path, .bytes = map(path, true)};
+        std::memcpy(segment.bytes.get(), magic.data(), magic.size());
+        m_segments.push_back(std::move(segment));
+    }
+
+    // Drops the oldest segments while the log is over its size, and those which only hold
+    // messages past their age.
+    void retire() {
+        const auto oldest = m_options.max_age.count() == 0
+                                ? INT64_MIN
+                                : now() - std::chrono::milliseconds(m_options.max_age).count();
+        while (m_segments.size() > 1 && (m_segments.size() * segment_size > m_options.max_size ||
+                                         m_segments.front().last_time < oldest)) {
+            std::error_code ignored;
+            std::filesystem::remove(m_segments.front().path, ignored);
+            m_segments.pop_front();
+        }
+    }
+
+    void write(Entry posted) {
+        const auto& frame = posted.frame;
+        const bool is_compressed = frame.v2_compressed.bytes().data() != frame.v2.bytes().data();
+        const RecordHeader header{
+            .size = std::uint32_t(aligned(
+                sizeof(RecordHeader) + frame.v1.size() + frame.v2.size() +
+                (is_compressed ? frame.v2_compressed.size() : 0))),
+            .v1_size = std::uint32_t(frame.v1.size()),
+            .v2_size = std::uint32_t(frame.v2.size()),
+            .v2_compressed_size = std::uint32_t(is_compressed ? frame.v2_compressed.size() : 0),
+            .time = posted.time,
+        };
+        if (header.size > segment_size - magic.size()) {
+            return;
+        }
+        if (m_segments.empty() || m_segments.back().size + header.size > segment_size) {
+            start_segment();
+        }
+
+        auto& segment = m_segments.back();
+        const auto offset = segment.size;
+        auto out = segment.bytes.get() + offset + sizeof header;
+        const std::array parts{&frame.v1, &frame.v2, &frame.v2_compressed};
+        for (const auto part : std::span(parts).first(is_compressed ? 3 : 2)) {
+            out = std::copy(part->bytes().begin(), part->bytes().end(), out);
+        }
+        // The header goes last, so that a record is only found once it is whole.
+        std::memcpy(segment.bytes.get() + offset, &header, sizeof header);
+        segment.size += header.size;
+        segment.last_time = posted.time;
+        // Marks the end, over whatever a record cut short before a restart left there.
+        if (segment.size + sizeof(RecordHeader) <= segment_size) {
+            std::memset(segment.bytes.get() + segment.size, 0, sizeof(RecordHeader::size));
+        }
+
+        index(entry_at(segment, offset, header));
+        retire();
+    }
+
+public:
+    // Opens the log in the given directory, creating it if need be, and replays the segments
+    // left there by a previous run. Files which are not segments are left alone.
+    History(std::filesystem::path dir, Options options)
+        : m_dir(std::move(dir)), m_options(options) {
+        std::filesystem::create_directories(m_dir);
+
+        std::vector<std::pair<std::uint64_t, std::filesystem::path>> files;
+        for (const auto& file : std::filesystem::directory_iterator(m_dir)) {
+            const auto name = file.path().stem().string();
+            std::uint64_t number = 0;
+            const auto end = name.data() + name.size();
+            const auto [parsed_end, error] = std::from_chars(name.data(), end, number);
+            if (file.path().extension() == ".log" && error == std::errc() && parsed_end == end) {
+                files.emplace_back(number, file.path());
+                m_next_segment = std::max(m_next_segment, number + 1);
+            }
+        }
+        std::sort(files.begin(), files.end());
+
+        for (const auto& [number, path] : files) {
+            auto bytes = map(path, false);
+            if (bytes == nullptr || std::memcmp(bytes.get(), magic.data(), magic.size()) != 0) {
+                continue;
+            }
+            Segment segment{.path = path, .bytes = std::move(bytes)};
+            while (const auto header = record_at(segment, segment.size)) {
+                index(entry_at(segment, segment.size, *header));
+                segment.size += header->size;
+                segment.last_time = header->time;
+            }
+            m_segments.push_back(std::move(segment));
+        }
+        retire();
+    }
+
+    History(const History&) = delete;
+    History& operator=(const History&) = delete;
+
+    // Queues a message to be written by run(). Can be called from any thread.
+    void append(Encoded frame) {
+        if (m_posted.post({.frame = std::move(frame), .time = now()})) {
+            // Orders the post before the flag, against the writer clearing the flag first.
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            m_has_posts.store(true, std::memory_order_relaxed);
+            m_has_posts.notify_one();
+        }
+    }
+
+    // Writes what is appended, for good. Meant to run on a thread of its own. The history being
+    // optional, a message which can't be written, for example because the disk is full, is
+    // left out of it rather than stopping the server.
+    void run() {
+        while (true) {
+            m_has_posts.wait(false, std::memory_order_relaxed);
+            m_has_posts.store(false, std::memory_order_relaxed);
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            m_posted.take([&](Entry&& entry) {
+                try {
+                    write(std::move(entry));
+                    m_is_failing = false;
+                } catch (const std::exception& e) {
+                    if (!std::exchange(m_is_failing, true)) {
+                        std::cerr << "termchat: history: " << e.what()
+                                  << ", messages are left out until it can be written again\n";
+                    }
+                }
+            });
+        }
+    }
+
+    // Calls f with each of the latest messages, oldest first, as frames pointing into the log.
+    // They are gathered in memory first, so that f may block. Can be called from any thread.
+    template <class F> void replay(std::pmr::memory_resource* memory, F&& f) {
+        const auto oldest = m_options.max_age.count() == 0
+                                ? INT64_MIN
+                                : now() - std::chrono::milliseconds(m_options.max_age).count();
+        std::pmr::vector<Encoded> recent(memory);
+        {
+            const std::lock_guard lock(m_mutex);
+            for (const auto& entry : m_index) {
+                if (entry.time >= oldest) {
+                    recent.push_back(entry.frame);
+                }
+            }
+        }
+        for (const auto& frame : recent) {
+            f(frame);
+        }
+    }
+};
+
+#endif // TERMCHAT_HISTORY_H
@@ -0,0 +1,62 @@
+#ifndef TERMCHAT_MAILBOX_H
+#define TERMCHAT_MAILBOX_H
+
+#include <atomic>
+#include <utility>
+
+// An unbounded queue into which any thread can post, emptied by a single owner thread.
+// It is lock-free: posting is a compare-and-swap on the head of a list, taking is an
+// exchange of it. Values posted by the same thread are taken in the order they were posted.
+template <class T> class Mailbox {
+private:
+    struct Node {
+        T value;
+        Node* next;
+    };
+
+    std::atomic<Node*> m_head = nullptr;
+
+public:
+    Mailbox() = default;
+    Mailbox(const Mailbox&) = delete;
+    Mailbox& operator=(const Mailbox&) = delete;
+
+    // Returns true if the mailbox was empty, in which case the owner might be waiting for
+    // something to happen and should be woken up.
+    bool post(T value) {
+        const auto node = new Node{.value = std::move(value), .next = nullptr};
+        node->next = m_head.load(std::memory_order_relaxed);
+        while (!m_head.compare_exchange_weak(
+            node->next, node, std::memory_order_release, std::memory_order_relaxed)) {
+        }
+        return node->next == nullptr;
+    }
+
+    // Takes everything posted so far and calls the given function with each value,
+    // in the order they were posted.
+    template <class F> void take(F&& f) {
+        auto node = m_head.exchange(nullptr, std::memory_order_acquire);
+
+        // The list is in reverse order of posting.
+        Node* reversed = nullptr;
+        while (node != nullptr) {
+            const auto next = node->next;
+            node->next = reversed;
+            reversed = node;
+            node = next;
+        }
+
+        while (reversed != nullptr) {
+            const auto next = reversed->next;
+            f(std::move(reversed->value));
+            delete reversed;
+            reversed = next;
+        }
+    }
+
+    ~Mailbox() {
+        take([](T&&) {});
+    }
+};
+
+#endif // TERMCHAT_MAILBOX_H
@@ -0,0 +1,137 @@
+#ifndef TERMCHAT_METRICS_H
+#define TERMCHAT_METRICS_H
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <bit>
+#include <charconv>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <string_view>
+
+// Metrics are kept by each thread for itself and summed when they are read, so that counting
+// is a plain add to memory no other thread writes: no locked instruction, no cache line
+// bouncing between cores.
+
+// A count written by a single thread, which any thread can read.
+class Counter {
+private:
+    std::atomic<std::uint64_t> m_value = 0;
+
+public:
+    // Writing thread only.
+    void add(std::uint64_t n = 1) noexcept {
+        m_value.store(m_value.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+    }
+
+    std::uint64_t get() const noexcept { return m_value.load(std::memory_order_relaxed); }
+};
+
+// Counts values in buckets whose upper bounds double from 2^first_bit on, with a last bucket
+// for the values above all of them. Written by a single thread, like a Counter.
+template <unsigned first_bit, std::size_t bound_count> class Histogram {
+public:
+    // What a reader sees, which can be added to the snapshots of other threads.
+    struct Snapshot {
+        // Not cumulative, the last one without an upper bound.
+        std::array<std::uint64_t, bound_count + 1> counts{};
+        std::uint64_t sum = 0;
+
+        Snapshot& operator+=(const Snapshot& other) noexcept {
+            for (std::size_t i = 0; i < counts.size(); ++i) {
+                counts[i] += other.counts[i];
+            }
+            sum += other.sum;
+            return *this;
+        }
+    };
+
+    static constexpr std::uint64_t upper_bound(std::size_t i) noexcept {
+        return std::uint64_t(1) << (first_bit + i);
+    }
+
+private:
+    std::array<Counter, bound_count + 1> m_counts;
+    Counter m_sum;
+
+public:
+    void observe(std::uint64_t v) noexcept {
+        const std::size_t i = v <= upper_bound(0) ? 0 : std::bit_width(v - 1) - first_bit;
+        m_counts[std::min(i, bound_count)].add();
+        m_sum.add(v);
+    }
+
+    Snapshot snapshot() const noexcept {
+        Snapshot s;
+        for (std::size_t i = 0; i < s.counts.size(); ++i) {
+            s.counts[i] = m_counts[i].get();
+        }
+        s.sum = m_sum.get();
+        return s;
+    }
+};
+
+// Writes metrics in the text format of Prometheus.
+class MetricsWriter {
+private:
+    std::string& m_out;
+
+    void header(std::string_view name, std::string_view type, std::string_view help) {
+        m_out.append("# HELP ").append(name).append(" ").append(help).append("\n");
+        m_out.append("# TYPE ").append(name).append(" ").append(type).append("\n");
+    }
+
+    void sample(std::string_view name, std::string_view labels, std::string_view value) {
+        m_out.append(name);
+        if (!labels.empty()) {
+            m_out.append("{").append(labels).append("}");
+        }
+        m_out.append(" ").append(value).append("\n");
+    }
+
+public:
+    // Appends to what out already holds.
+    explicit MetricsWriter(std::string& out) : m_out(out) {}
+
+    void counter(std::string_view name, std::string_view help, std::uint64_t value) {
+        header(name, "counter", help);
+        sample(name, {}, std::to_string(value));
+    }
+
+    void gauge(std::string_view name, std::string_view help, std::int64_t value) {
+        header(name, "gauge", help);
+        sample(name, {}, std::to_string(value));
+    }
+
+    // The values are divided by unit, for example to turn nanoseconds into seconds.
+    template <class H>
+    void histogram(
+        std::string_view name, std::string_view help, const typename H::Snapshot& s,
+        double unit = 1) {
+        header(name, "histogram", help);
+
+        const auto bucket = std::string(name) + "_bucket";
+        std::uint64_t cumulative = 0;
+        for (std::size_t i = 0; i + 1 < s.counts.size(); ++i) {
+            cumulative += s.counts[i];
+            sample(bucket, "le=\"" + format(H::upper_bound(i) / unit) + "\"",
+                   std::to_string(cumulative));
+        }
+        cumulative += s.counts.back();
+        sample(bucket, "le=\"+Inf\"", std::to_string(cumulative));
+        sample(std::string(name) + "_sum", {}, format(s.sum / unit));
+        sample(std::string(name) + "_count", {}, std::to_string(cumulative));
+    }
+
+private:
+    // As short as it can be without losing precision.
+    static std::string format(double v) {
+        std::array<char, 32> buf;
+        const auto res = std::to_chars(buf.data(), buf.data() + buf.size(), v);
+        return std::string(buf.data(), res.ptr);
+    }
+};
+
+#endif // TERMCHAT_METRICS_H
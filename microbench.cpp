@@ -0,0 +1,458 @@
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <cstdlib>
+#include <memory>
+#include <memory_resource>
+#include <new>
+#include <numeric>
+#include <optional>
+#include <random>
+#include <string>
+#include <vector>
+
+#include <benchmark/benchmark.h>
+#include <sys/resource.h>
+
+#include "chat.h"
+#include "protocol.h"
+#include "socket.h"
+#include "text.h"
+
+// Microbenchmarks of the server's hot paths. Each reports, besides its timings, how many
+// allocations an iteration makes on average, as allocs.
+
+static std::atomic<std::size_t> allocation_count = 0;
+
+// All the forms are replaced together, on top of malloc and free, so that whatever form
+// allocates, the matching one frees. They are kept out of line: once inlined, GCC takes a
+// free() of what operator new returned for a mismatch.
+[[gnu::noinline]] static void* allocate(std::size_t size) noexcept {
+    allocation_count.fetch_add(1, std::memory_order_relaxed);
+    return std::malloc(size == 0 ? 1 : size);
+}
+
+[[gnu::noinline]] static void* allocate(std::size_t size, std::align_val_t alignment) noexcept {
+    allocation_count.fetch_add(1, std::memory_order_relaxed);
+    const auto align = std::max(std::size_t(alignment), sizeof(void*));
+    // aligned_alloc() wants a multiple of the alignment.
+    return std::aligned_alloc(align, (std::max<std::size_t>(size, 1) + align - 1) / align * align);
+}
+
+[[gnu::noinline]] static void deallocate(void* p) noexcept { std::free(p); }
+
+template <class... Alignment> static void* allocate_or_throw(std::size_t size, Alignment... a) {
+    if (auto p = allocate(size, a...)) {
+        return p;
+    }
+    throw std::bad_alloc();
+}
+
+void* operator new(std::size_t size) { return allocate_or_throw(size); }
+void* operator new[](std::size_t size) { return allocate_or_throw(size); }
+void* operator new(std::size_t size, std::align_val_t a) { return allocate_or_throw(size, a); }
+void* operator new[](std::size_t size, std::align_val_t a) { return allocate_or_throw(size, a); }
+void* operator new(std::size_t size, const std::nothrow_t&) noexcept { return allocate(size); }
+void* operator new[](std::size_t size, const std::nothrow_t&) noexcept { return allocate(size); }
+
+void operator delete(void* p) noexcept { deallocate(p); }
+void operator delete[](void* p) noexcept { deallocate(p); }
+void operator delete(void* p, std::size_t) noexcept { deallocate(p); }
+void operator delete[](void* p, std::size_t) noexcept { deallocate(p); }
+void operator delete(void* p, std::align_val_t) noexcept { deallocate(p); }
+void operator delete[](void* p, std::align_val_t) noexcept { deallocate(p); }
+void operator delete(void* p, std::size_t, std::align_val_t) noexcept { deallocate(p); }
+void operator delete[](void* p, std::size_t, std::align_val_t) noexcept { deallocate(p); }
+void operator delete(void* p, const std::nothrow_t&) noexcept { deallocate(p); }
+void operator delete[](void* p, const std::nothrow_t&) noexcept { deallocate(p); }
+
+namespace {
+// Reports the allocations made from its construction to its destruction, per iteration.
+class CountAllocations {
+private:
+    benchmark::State& m_state;
+    std::size_t m_start;
+
+public:
+    explicit CountAllocations(benchmark::State& state)
+        : m_state(state), m_start(allocation_count.load(std::memory_order_relaxed)) {}
+
+    ~CountAllocations() {
+        const auto n = allocation_count.load(std::memory_order_relaxed) - m_start;
+        m_state.counters["allocs"] = benchmark::Counter(n, benchmark::Counter::kAvgIterations);
+    }
+};
+
+std::string text_of_size(std::size_t size) {
+    std::string s(size, 'x');
+    for (std::size_t i = 0; i < size; ++i) {
+        s[i] = 'a' + i % 26;
+    }
+    return s;
+}
+
+// Lines of a pasted snippet.
+std::string lines(std::size_t count) {
+    std::string s;
+    for (std::size_t i = 0; i < count; ++i) {
+        s += "    for (auto& record : registry.records()) {";
+        if (i + 1 < count) {
+            s += '\n';
+        }
+    }
+    return s;
+}
+
+Username user_name(std::size_t i) { return *Username::parse("user-" + std::to_string(i)); }
+
+// A server with connections to it, for the benchmarks which need real clients. It listens on
+// the first free port from 47000 on.
+struct Loopback {
+    std::optional<Server> server;
+    std::vector<std::unique_ptr<Client>> clients;
+    std::vector<ServerClient> accepted;
+
+    explicit Loopback(std::size_t count) {
+        unsigned short port = 47000;
+        for (; !server.has_value(); ++port) {
+            try {
+                server.emplace(port);
+            } catch (const SocketError&) {
+            }
+        }
+        --port;
+
+        for (std::size_t i = 0; i < count; ++i) {
+            clients.push_back(std::make_unique<Client>("127.0.0.1", port));
+        }
+        std::vector<ServerPollResult> polled;
+        while (accepted.size() < count) {
+            server->poll(polled);
+            for (auto& [client, status] : polled) {
+                if (status == ServerClientStatus::New) {
+                    accepted.push_back(client);
+                }
+            }
+        }
+    }
+
+    // Reads what the server sent to the clients.
+    void drain() {
+        std::vector<std::byte> buf;
+        for (auto& client : clients) {
+            while (client->try_recv(buf).ok()) {
+                buf.clear();
+            }
+        }
+    }
+};
+
+//
+// Protocol
+//
+
+void BM_Pack(benchmark::State& state) {
+    const auto msg = text_of_size(state.range(0));
+    std::vector<std::byte> buf;
+
+    CountAllocations count(state);
+    for (auto _ : state) {
+        buf.clear();
+        proto::pack(msg, buf);
+        benchmark::DoNotOptimize(buf.data());
+    }
+    state.SetBytesProcessed(state.iterations() * msg.size());
+}
+BENCHMARK(BM_Pack)->Arg(16)->Arg(256)->Arg(4096);
+
+void BM_UnpackHeader(benchmark::State& state) {
+    std::vector<std::byte> buf;
+    proto::pack(text_of_size(100), buf);
+
+    CountAllocations count(state);
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(proto::unpack_header(buf));
+    }
+}
+BENCHMARK(BM_UnpackHeader);
+
+void BM_Unpack(benchmark::State& state) {
+    const auto msg = text_of_size(state.range(0));
+    std::vector<std::byte> buf;
+    proto::pack(msg, buf);
+    const auto body = std::span(buf).subspan(proto::header_size);
+
+    CountAllocations count(state);
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(proto::unpack(body, msg.size()));
+    }
+    state.SetBytesProcessed(state.iterations() * msg.size());
+}
+BENCHMARK(BM_Unpack)->Arg(16)->Arg(256)->Arg(4096);
+
+// Splits a stream of version 1 frames into messages, as the server does on each receive.
+void BM_Decode(benchmark::State& state) {
+    constexpr std::size_t frame_count = 64;
+    const auto msg = text_of_size(state.range(0));
+    std::vector<std::byte> stream;
+    for (std::size_t i = 0; i < frame_count; ++i) {
+        proto::pack(msg, stream);
+    }
+    proto::Decoder decoder(proto::Version::V1);
+
+    CountAllocations count(state);
+    for (auto _ : state) {
+        auto& buf = decoder.buffer();
+        buf.insert(buf.end(), stream.begin(), stream.end());
+        while (decoder.next().status == proto::Decoder::Status::Message) {
+        }
+    }
+    state.SetItemsProcessed(state.iterations() * frame_count);
+    state.SetBytesProcessed(state.iterations() * stream.size());
+}
+BENCHMARK(BM_Decode)->Arg(16)->Arg(256)->Arg(4096);
+
+//
+// Rendering
+//
+
+void BM_UsernameParse(benchmark::State& state) {
+    const std::vector<std::string> names{"alice", "bob_the-builder", "Not Valid", "user-12345"};
+
+    CountAllocations count(state);
+    std::size_t i = 0;
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(Username::parse(names[i++ % names.size()]));
+    }
+}
+BENCHMARK(BM_UsernameParse);
+
+void BM_Indent(benchmark::State& state) {
+    const auto text = lines(state.range(0));
+    std::vector<std::byte> buf;
+
+    CountAllocations count(state);
+    for (auto _ : state) {
+        buf.clear();
+        proto::Writer out(buf);
+        out << indent(text);
+        benchmark::DoNotOptimize(out.finish(proto::Version::V2));
+    }
+    state.SetBytesProcessed(state.iterations() * text.size());
+}
+BENCHMARK(BM_Indent)->Arg(1)->Arg(10)->Arg(80);
+
+// The kernel behind indent, with each instruction set, on a pasted snippet or on a single line.
+void BM_WriteIndented(benchmark::State& state) {
+    const auto isa = text::Isa(state.range(0));
+    const auto text = state.range(1) == 0 ? text_of_size(4096) : lines(state.range(1));
+    std::string out(text::indented_size(text), '\0');
+
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(text::write_indented(text, out.data(), isa));
+        benchmark::ClobberMemory();
+    }
+    state.SetBytesProcessed(state.iterations() * text.size());
+}
+BENCHMARK(BM_WriteIndented)->ArgsProduct({{0, 1, 2}, {0, 80}});
+
+// Encodes a rendered snippet in each version, in several frames once it outgrows one.
+void BM_Encode(benchmark::State& state) {
+    std::vector<std::byte> buf;
+    proto::Writer out(buf);
+    out << indent(lines(state.range(0)));
+    const auto body = out.body();
+
+    CountAllocations count(state);
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(encode(body, false));
+    }
+    state.SetBytesProcessed(state.iterations() * body.size());
+}
+BENCHMARK(BM_Encode)->Arg(10)->Arg(80)->Arg(400);
+
+//
+// Registry
+//
+
+// A registry of the given number of registered clients. All the records share a single
+// connection: the registry only ever touches its tag.
+struct Populated {
+    Loopback loopback{1};
+    Directory directory;
+    Registry registry{directory, 0};
+    std::vector<Registry::Handle> handles;
+
+    explicit Populated(std::size_t count) {
+        auto& client = loopback.accepted.front();
+        for (std::size_t i = 0; i < count; ++i) {
+            client.set_tag(0);
+            const auto handle = registry.add_unregistered(client);
+            registry.register_client(handle, user_name(i));
+            handles.push_back(handle);
+        }
+    }
+};
+
+// A client joins, picks a user name and leaves.
+void BM_RegistryRegisterRemove(benchmark::State& state) {
+    Populated populated(state.range(0));
+    auto& client = populated.loopback.accepted.front();
+    const auto name = user_name(state.range(0));
+
+    CountAllocations count(state);
+    for (auto _ : state) {
+        client.set_tag(0);
+        const auto handle = populated.registry.add_unregistered(client);
+        populated.registry.register_client(handle, name);
+        populated.registry.remove(handle);
+    }
+}
+BENCHMARK(BM_RegistryRegisterRemove)->RangeMultiplier(10)->Range(10, 100'000);
+
+void BM_RegistryFind(benchmark::State& state) {
+    Populated populated(state.range(0));
+    auto handles = populated.handles;
+    std::shuffle(handles.begin(), handles.end(), std::mt19937_64(1));
+
+    CountAllocations count(state);
+    std::size_t i = 0;
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(populated.registry.find(handles[i++ % handles.size()]));
+    }
+}
+BENCHMARK(BM_RegistryFind)->RangeMultiplier(10)->Range(10, 100'000);
+
+// Finds a recipient by user name, through the directory.
+void BM_RegistryLocate(benchmark::State& state) {
+    Populated populated(state.range(0));
+    std::vector<Username> names;
+    for (std::size_t i = 0; i < populated.handles.size(); ++i) {
+        names.push_back(user_name(i));
+    }
+    std::shuffle(names.begin(), names.end(), std::mt19937_64(1));
+
+    CountAllocations count(state);
+    std::size_t i = 0;
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(populated.registry.locate(names[i++ % names.size()]));
+    }
+}
+BENCHMARK(BM_RegistryLocate)->RangeMultiplier(10)->Range(10, 100'000);
+
+// A member of a channel of the given size leaves it and joins it again.
+void BM_ChannelLeaveJoin(benchmark::State& state) {
+    Populated populated(state.range(0));
+    const auto channel = *parse_channel_name("#room");
+    for (const auto handle : populated.handles) {
+        populated.registry.join(handle, channel);
+    }
+    auto handles = populated.handles;
+    std::shuffle(handles.begin(), handles.end(), std::mt19937_64(1));
+
+    CountAllocations count(state);
+    std::size_t i = 0;
+    for (auto _ : state) {
+        const auto handle = handles[i++ % handles.size()];
+        populated.registry.leave(handle, channel);
+        populated.registry.join(handle, channel);
+    }
+}
+BENCHMARK(BM_ChannelLeaveJoin)->RangeMultiplier(10)->Range(10, 100'000);
+
+// A broadcast to all the clients of a shard, up to the system calls which write it, with
+// connected sockets on the other end.
+void BM_SendToRegisteredExcept(benchmark::State& state) {
+    Loopback loopback(state.range(0));
+    Directory directory;
+    Registry registry(directory, 0);
+    for (std::size_t i = 0; i < loopback.accepted.size(); ++i) {
+        const auto handle = registry.add_unregistered(loopback.accepted[i]);
+        registry.register_client(handle, user_name(i));
+    }
+    const auto frame = encode("\nuser-0 to everyone:\n  " + text_of_size(64) + "\n> ");
+    std::pmr::vector<Registry::Handle> failed;
+    std::vector<ServerPollResult> polled;
+
+    CountAllocations count(state);
+    std::size_t sent = 0;
+    for (auto _ : state) {
+        registry.send_to_registered_except(std::nullopt, frame, failed);
+        // So that the poll writes what was queued and returns without waiting.
+        loopback.server->wake();
+        loopback.server->poll(polled);
+
+        // Well before the sockets' buffers are full.
+        if (++sent % 256 == 0) {
+            state.PauseTiming();
+            loopback.drain();
+            state.ResumeTiming();
+        }
+    }
+    if (!failed.empty()) {
+        state.SkipWithError("a send failed");
+    }
+    state.SetItemsProcessed(state.iterations() * loopback.accepted.size());
+}
+BENCHMARK(BM_SendToRegisteredExcept)->RangeMultiplier(10)->Range(1, 1000);
+
+// A message to a channel of ten of the given number of clients of a shard, which costs the
+// same whatever the number of clients outside of the channel.
+void BM_SendToChannelExcept(benchmark::State& state) {
+    Loopback loopback(state.range(0));
+    Directory directory;
+    Registry registry(directory, 0);
+    const auto channel = *parse_channel_name("#room");
+    std::size_t members = 0;
+    for (std::size_t i = 0; i < loopback.accepted.size(); ++i) {
+        const auto handle = registry.add_unregistered(loopback.accepted[i]);
+        registry.register_client(handle, user_name(i));
+        if (i % std::max<std::size_t>(loopback.accepted.size() / 10, 1) == 0 && members < 10) {
+            registry.join(handle, channel);
+            ++members;
+        }
+    }
+    const auto frame = encode("\nuser-0 to #room:\n  " + text_of_size(64) + "\n> ");
+    std::pmr::vector<Registry::Handle> failed;
+    std::vector<ServerPollResult> polled;
+
+    CountAllocations count(state);
+    std::size_t sent = 0;
+    for (auto _ : state) {
+        registry.send_to_channel_except(channel, std::nullopt, frame, failed);
+        loopback.server->wake();
+        loopback.server->poll(polled);
+
+        if (++sent % 256 == 0) {
+            state.PauseTiming();
+            loopback.drain();
+            state.ResumeTiming();
+        }
+    }
+    if (!failed.empty()) {
+        state.SkipWithError("a send failed");
+    }
+    state.SetItemsProcessed(state.iterations() * members);
+}
+BENCHMARK(BM_SendToChannelExcept)->Arg(10)->Arg(100)->Arg(1000);
+
+// Two descriptors per connection of the loopback benchmarks.
+void raise_file_limit() {
+    rlimit limit;
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < limit.rlim_max) {
+        limit.rlim_cur = std::min<rlim_t>(limit.rlim_max, 4096);
+        setrlimit(RLIMIT_NOFILE, &limit);
+    }
+}
+} // namespace
+
+int main(int argc, char** argv) {
+    raise_file_limit();
+
+    benchmark::Initialize(&argc, argv);
+    if (benchmark::ReportUnrecognizedArguments(argc, argv)) {
+        return 1;
+    }
+    benchmark::RunSpecifiedBenchmarks();
+    benchmark::Shutdown();
+}
@@ -1,10 +1,16 @@
+#include <algorithm>
 #include <arpa/inet.h>
+#include <array>
 #include <cstddef>
 #include <cstdint>
+#include <cstring>
+#include <new>
 #include <optional>
 #include <span>
 #include <string>
+#include <utility>
 #include <vector>
+#include <zlib.h>
 
 #include "protocol.h"
 
@@ -21,6 +27,215 @@ void proto::pack(std::string_view v, std::vector<std::byte>& out) {
     out.insert(out.end(), v_addr, v_addr + v.size());
 }
 
+std::array<std::byte, proto::hello_size> proto::hello(Encoding encoding) noexcept {
+    std::array<std::byte, hello_size> out;
+    std::copy(hello_magic.begin(), hello_magic.end(), out.begin());
+    out[hello_magic.size()] = std::byte(encoding.version);
+    out[hello_magic.size() + 1] =
+        encoding.is_compressed ? std::byte(Feature::Compression) : std::byte(0);
+    return out;
+}
+
+proto::Encoding proto::read_hello(std::span<const std::byte, hello_size> hello) noexcept {
+    const auto requested = std::to_integer<std::uint8_t>(hello[hello_magic.size()]);
+    const auto features = std::to_integer<std::uint8_t>(hello[hello_magic.size() + 1]);
+
+    Encoding encoding;
+    if (requested >= std::uint8_t(latest_version)) {
+        encoding.version = latest_version;
+    } else if (requested > std::uint8_t(Version::V1)) {
+        encoding.version = Version(requested);
+    }
+    encoding.is_compressed = encoding.version != Version::V1 &&
+                             (features & std::uint8_t(Feature::Compression)) != 0;
+    return encoding;
+}
+
+std::size_t proto::write_header(
+    Version version, FrameType type, std::size_t body_size,
+    std::span<std::byte, max_header_size> out, bool is_compressed) noexcept {
+    if (version == Version::V1) {
+        const auto nv = htonll(body_size);
+        std::memcpy(out.data(), &nv, sizeof nv);
+        return sizeof nv;
+    }
+
+    out[0] = std::byte(std::uint8_t(type) | (is_compressed ? compressed_flag : 0));
+    std::size_t n = 1;
+    // 7 bits at a time, least significant first, the high bit telling whether more follow.
+    for (; body_size >= 0x80; body_size >>= 7) {
+        out[n++] = std::byte(body_size | 0x80);
+    }
+    out[n++] = std::byte(body_size);
+    return n;
+}
+
+proto::Writer::Writer(std::vector<std::byte>& buf) : m_buf(buf), m_start(buf.size()) {
+    m_buf.resize(m_start + max_header_size);
+}
+
+proto::Writer& proto::Writer::operator<<(std::string_view s) {
+    const auto s_addr = reinterpret_cast<const std::byte*>(s.data());
+    m_buf.insert(m_buf.end(), s_addr, s_addr + s.size());
+    return *this;
+}
+
+proto::Writer& proto::Writer::operator<<(char c) {
+    m_buf.push_back(std::byte(c));
+    return *this;
+}
+
+std::span<std::byte> proto::Writer::extend(std::size_t n) {
+    const auto size = m_buf.size();
+    m_buf.resize(size + n);
+    return std::span(m_buf).subspan(size);
+}
+
+std::span<const std::byte> proto::Writer::body() const noexcept {
+    return std::span<const std::byte>(m_buf).subspan(m_start + max_header_size);
+}
+
+std::span<const std::byte> proto::Writer::finish(Version version, FrameType type) noexcept {
+    std::array<std::byte, max_header_size> header;
+    const auto n = write_header(version, type, body().size(), header);
+
+    // The header ends where the body starts, whatever its length.
+    const auto pos = m_start + max_header_size - n;
+    std::copy(header.begin(), header.begin() + n, m_buf.begin() + pos);
+    return std::span<const std::byte>(m_buf).subspan(pos);
+}
+
+// Raw deflate streams, without a zlib header or checksum: the frame already delimits them.
+constexpr int window_bits = -15;
+
+struct proto::Compressor::Private {
+    z_stream z{};
+    std::vector<std::byte> dictionary;
+};
+
+proto::Compressor::Compressor(std::span<const std::byte> dictionary)
+    : m(std::make_unique<Private>()) {
+    m->dictionary.assign(dictionary.begin(), dictionary.end());
+    if (deflateInit2(&m->z, Z_DEFAULT_COMPRESSION, Z_DEFLATED, window_bits, 8,
+                     Z_DEFAULT_STRATEGY) != Z_OK) {
+        throw std::bad_alloc();
+    }
+}
+
+proto::Compressor::~Compressor() { deflateEnd(&m->z); }
+
+bool proto::Compressor::compress(std::span<const std::byte> in, std::vector<std::byte>& out) {
+    auto& z = m->z;
+    deflateReset(&z);
+    if (!m->dictionary.empty()) {
+        deflateSetDictionary(
+            &z, reinterpret_cast<const Bytef*>(m->dictionary.data()), m->dictionary.size());
+    }
+
+    // Room for no more than the input: a longer output is no gain.
+    const auto start = out.size();
+    out.resize(start + in.size());
+    z.next_in = const_cast<Bytef*>(reinterpret_cast<const Bytef*>(in.data()));
+    z.avail_in = in.size();
+    z.next_out = reinterpret_cast<Bytef*>(out.data() + start);
+    z.avail_out = in.size();
+
+    if (deflate(&z, Z_FINISH) != Z_STREAM_END || z.avail_out == 0) {
+        out.resize(start);
+        return false;
+    }
+    out.resize(start + in.size() - z.avail_out);
+    return true;
+}
+
+struct proto::Decompressor::Private {
+    z_stream z{};
+    std::vector<std::byte> dictionary;
+};
+
+proto::Decompressor::Decompressor(std::span<const std::byte> dictionary)
+    : m(std::make_unique<Private>()) {
+    m->dictionary.assign(dictionary.begin(), dictionary.end());
+    if (inflateInit2(&m->z, window_bits) != Z_OK) {
+        throw std::bad_alloc();
+    }
+}
+
+proto::Decompressor::~Decompressor() { inflateEnd(&m->z); }
+
+bool proto::Decompressor::decompress(
+    std::span<const std::byte> in, std::size_t max_size, std::string& out) {
+    auto& z = m->z;
+    inflateReset(&z);
+    if (!m->dictionary.empty()) {
+        inflateSetDictionary(
+            &z, reinterpret_cast<const Bytef*>(m->dictionary.data()), m->dictionary.size());
+    }
+
+    out.resize(max_size);
+    z.next_in = const_cast<Bytef*>(reinterpret_cast<const Bytef*>(in.data()));
+    z.avail_in = in.size();
+    z.next_out = reinterpret_cast<Bytef*>(out.data());
+    z.avail_out = max_size;
+
+    // Not reaching the end means that the output doesn't fit, or that the input is cut short.
+    const bool is_valid = inflate(&z, Z_FINISH) == Z_STREAM_END;
+    out.resize(is_valid ? max_size - z.avail_out : 0);
+    return is_valid;
+}
+
+// Ordered from the least to the most common, as deflate favors the closest matches.
+const std::string_view proto::dictionary =
+    "Hi there! Please give us your username.\n> "
+    "That's not a valid user name. Try again!\n> "
+    "This user name is taken. Try again!\n> "
+    "Can't send empty message. Try again!\n> "
+    "Invalid user name. Try again!\n> "
+    "This user doesn't exist. Misspelled?\n> "
+    "I couldn't quite get that. Can you say it again?\n> "
+    "Registered!\nCurrently active users:\n - "
+    "To send a message to someone, type \"<username> <your message>\"\n"
+    "To send a message to everyone, type \"bc <your message>\"\n"
+    "Happy chatting!\n\n> "
+    " (you)\n"
+    " has been disconnected.\n> "
+    " has left.\n> "
+    " is here!\n> "
+    "\nNote to self:\n  "
+    " to you:\n  "
+    " to everyone:\n  ";
+
+static std::span<const std::byte> dictionary_bytes() noexcept {
+    return std::as_bytes(std::span(proto::dictionary));
+}
+
+bool proto::compress(std::span<const std::byte> in, std::vector<std::byte>& out) {
+    thread_local Compressor compressor(dictionary_bytes());
+    return compressor.compress(in, out);
+}
+
+bool proto::decompress(std::span<const std::byte> in, std::string& out) {
+    thread_local Decompressor decompressor(dictionary_bytes());
+    return decompressor.decompress(in, max_body_size, out);
+}
+
+std::size_t proto::first_piece_size(std::string_view message) noexcept {
+    if (message.size() <= max_body_size) {
+        return message.size();
+    }
+    // Unless that would make the piece much shorter.
+    const auto line_end = message.rfind('\n', max_body_size - 1);
+    if (line_end != std::string_view::npos && line_end >= max_body_size / 2) {
+        return line_end + 1;
+    }
+    // Backs off to the start of the character cut short, unless the text is not UTF-8.
+    auto size = max_body_size;
+    while (size > max_body_size - 4 && (std::uint8_t(message[size]) & 0xc0) == 0x80) {
+        --size;
+    }
+    return size == max_body_size - 4 ? max_body_size : size;
+}
+
 const std::size_t proto::header_size = sizeof(uint64_t);
 
 std::optional<std::size_t> proto::unpack_header(std::span<const std::byte> in) noexcept {
@@ -48,3 +263,171 @@ proto::unpack(std::span<const std::byte> in, std::size_t expected_len) noexcept
 
     return s;
 }
+
+// Longest batch a client can send.
+constexpr std::size_t max_batch_size = 1 << 16;
+
+namespace {
+struct Header {
+    enum class Status { Complete, Invalid, Incomplete } status;
+    proto::FrameType type = proto::FrameType::Data;
+    bool is_compressed = false;
+    // Of the header itself, which is consumed even if it is not valid.
+    std::size_t size = 0;
+    std::size_t body_size = 0;
+};
+} // namespace
+
+static Header read_header(proto::Version version, std::span<const std::byte> in) noexcept {
+    if (version == proto::Version::V1) {
+        if (in.size() < proto::header_size) {
+            return {.status = Header::Status::Incomplete};
+        }
+        const auto len = proto::unpack_header(in);
+        if (!len.has_value()) {
+            return {.status = Header::Status::Invalid, .size = proto::header_size};
+        }
+        return {.status = Header::Status::Complete, .size = proto::header_size, .body_size = *len};
+    }
+
+    if (in.empty()) {
+        return {.status = Header::Status::Incomplete};
+    }
+    const auto type_byte = std::to_integer<std::uint8_t>(in[0]);
+    const auto type = proto::FrameType(type_byte & ~proto::compressed_flag);
+    const bool is_compressed = (type_byte & proto::compressed_flag) != 0;
+    if (type > proto::FrameType::Chunk || (is_compressed && type == proto::FrameType::Batch)) {
+        return {.status = Header::Status::Invalid, .size = 1};
+    }
+    const auto max_size =
+        type == proto::FrameType::Batch ? max_batch_size : proto::max_body_size;
+
+    std::uint64_t len = 0;
+    for (std::size_t i = 1; i < in.size(); ++i) {
+        const auto b = std::to_integer<std::uint64_t>(in[i]);
+        len |= (b & 0x7f) << (7 * (i - 1));
+        if (len > max_size || i + 1 == proto::max_header_size) {
+            return {.status = Header::Status::Invalid, .size = i + 1};
+        }
+        if ((b & 0x80) == 0) {
+            return {
+                .status = Header::Status::Complete,
+                .type = type,
+                .is_compressed = is_compressed,
+                .size = i + 1,
+                .body_size = len,
+            };
+        }
+    }
+    return {.status = Header::Status::Incomplete};
+}
+
+std::vector<std::byte>& proto::Decoder::buffer() noexcept {
+    // Keep only the incomplete part so that the buffer doesn't grow unbounded.
+    m_buf.erase(m_buf.begin(), m_buf.begin() + m_pos);
+    m_pos = 0;
+    return m_buf;
+}
+
+proto::Decoder::Result proto::Decoder::next() {
+    for (;;) {
+        const auto in = std::span<const std::byte>(m_buf).subspan(m_pos);
+
+        if (!m_version.has_value()) {
+            if (in.empty()) {
+                return {.status = Status::Incomplete};
+            }
+            if (in[0] != hello_magic[0]) {
+                m_version = Version::V1;
+                continue;
+            }
+            if (in.size() < hello_size) {
+                return {.status = Status::Incomplete};
+            }
+
+            m_pos += hello_size;
+            if (!std::equal(hello_magic.begin(), hello_magic.end(), in.begin())) {
+                m_version = Version::V1;
+                return {.status = Status::Invalid};
+            }
+            m_hello = read_hello(in.first<hello_size>());
+            m_version = m_hello->version;
+            return {.status = Status::Hello};
+        }
+
+        if (!m_body_len.has_value()) {
+            const auto header = read_header(*m_version, in);
+            if (header.status == Header::Status::Incomplete) {
+                return {.status = Status::Incomplete};
+            }
+
+            m_pos += header.size;
+            if (m_batch_left.has_value()) {
+                // Frames of a batch must fit in it.
+                if (header.status == Header::Status::Invalid ||
+                    header.type == FrameType::Batch ||
+                    header.size + header.body_size > *m_batch_left) {
+                    m_batch_left.reset();
+                    return {.status = Status::Invalid};
+                }
+                *m_batch_left -= header.size + header.body_size;
+                if (*m_batch_left == 0) {
+                    m_batch_left.reset();
+                }
+            }
+            if (header.status == Header::Status::Invalid) {
+                return {.status = Status::Invalid};
+            }
+
+            if (header.type == FrameType::Batch) {
+                // The frames of the batch follow as if they had been sent one by one.
+                if (header.body_size > 0) {
+                    m_batch_left = header.body_size;
+                }
+                continue;
+            }
+            m_type = header.type;
+            m_is_compressed = header.is_compressed;
+            m_body_len = header.body_size;
+            continue;
+        }
+
+        if (in.size() < *m_body_len) {
+            return {.status = Status::Incomplete};
+        }
+        const auto body = in.first(*m_body_len);
+        m_pos += body.size();
+        m_body_len.reset();
+
+        std::string_view message(reinterpret_cast<const char*>(body.data()), body.size());
+        if (m_is_compressed) {
+            if (!decompress(body, m_inflated)) {
+                return {.status = Status::Invalid};
+            }
+            message = m_inflated;
+        }
+
+        switch (m_type) {
+        case FrameType::Disconnect:
+            return {.status = Status::Disconnect};
+        case FrameType::Ping:
+            return {.status = Status::Ping};
+        case FrameType::Chunk:
+            return {
+                .status = Status::Chunk,
+                .message = message,
+                .is_continuation = std::exchange(m_is_in_message, true),
+            };
+        default:
+            if (*m_version == Version::V1 && message.empty()) {
+                // Version 1 has nothing but an empty message to signal a disconnect.
+                return {.status = Status::Disconnect};
+            }
+            return {
+                .status = Status::Message,
+                .message = message,
+                .is_continuation = std::exchange(m_is_in_message, false),
+            };
+        }
+    }
+}
@@ -1,18 +1,234 @@
 #ifndef TERMCHAT_PROTOCOL_H
 #define TERMCHAT_PROTOCOL_H
 
+#include <array>
 #include <cstddef>
+#include <cstdint>
+#include <memory>
 #include <optional>
 #include <span>
+#include <string>
 #include <string_view>
 #include <vector>
 
 namespace proto {
+// Version 1 frames a message with an 8-byte big-endian length, and an empty message means
+// that the client disconnects. Version 2 frames it with a type byte and a varint length.
+// Connections start with version 1. A client asks for a later version, and for features, by
+// sending a hello before anything else, then waits for the server to answer with a hello
+// holding what it picked. Both sides use that for everything they send after the hellos.
+enum class Version : std::uint8_t {
+    V1 = 1,
+    V2 = 2,
+};
+
+constexpr Version latest_version = Version::V2;
+
+// What a version 2 frame carries. The compressed flag may be added to any type but Batch.
+enum class FrameType : std::uint8_t {
+    // A message.
+    Data = 0,
+    // The client is leaving.
+    Disconnect = 1,
+    // Answered with a ping by the server, for example to check that the connection is alive.
+    Ping = 2,
+    // Other frames, which are handled as if they had been received one by one. Batches
+    // don't nest.
+    Batch = 3,
+    // A piece of a message too long for a frame. The message goes on in the frames of this
+    // type which follow, up to the Data frame holding its last piece. Other types of frames
+    // may come in between.
+    Chunk = 4,
+};
+
+// Set in the type byte of a frame whose body is compressed, see compress().
+constexpr std::uint8_t compressed_flag = 0x80;
+
+// How a peer encodes what it sends.
+struct Encoding {
+    Version version = Version::V1;
+    // Whether bodies may be compressed, which needs version 2.
+    bool is_compressed = false;
+
+    bool operator==(const Encoding&) const = default;
+};
+
+// Features of a hello, as flags.
+enum class Feature : std::uint8_t {
+    Compression = 1,
+};
+
+// A hello is these bytes followed by a version and the features. The first byte of a
+// version 1 header is always zero, so the two can't be confused.
+constexpr std::array<std::byte, 4> hello_magic{
+    std::byte('T'), std::byte('C'), std::byte('H'), std::byte('T')};
+constexpr std::size_t hello_size = hello_magic.size() + 2;
+
+std::array<std::byte, hello_size> hello(Encoding encoding) noexcept;
+// Returns what the given hello asks for, limited to what this side supports: for a server,
+// that's what it picks.
+Encoding read_hello(std::span<const std::byte, hello_size> hello) noexcept;
+
 void pack(std::string_view data, std::vector<std::byte>& out);
 
 extern const std::size_t header_size;
 std::optional<std::size_t> unpack_header(std::span<const std::byte> in) noexcept;
 std::optional<std::string> unpack(std::span<const std::byte> in, std::size_t expected_len) noexcept;
+
+// Longest body a frame can have.
+constexpr std::size_t max_body_size = 4096;
+// Longest header of any version: a type byte and a varint of up to 64 bits.
+constexpr std::size_t max_header_size = 11;
+
+// The size of the first piece of a message sent in chunks: as much as fits in a frame, up to
+// the end of the last line which does if it's not too short, without splitting a UTF-8
+// character.
+std::size_t first_piece_size(std::string_view message) noexcept;
+
+// Writes the header of a frame whose body has the given size, and returns its size.
+// Version 1 has no frame types nor compression, so the header is the same for all of them.
+std::size_t write_header(
+    Version version, FrameType type, std::size_t body_size,
+    std::span<std::byte, max_header_size> out, bool is_compressed = false) noexcept;
+
+// Deflates independent messages, each primed with the same dictionary if there is one, so
+// that short messages compress well and can be decompressed in any order. A Compressor
+// keeps its zlib stream across calls, and is used by one thread at a time.
+class Compressor {
+private:
+    struct Private;
+    std::unique_ptr<Private> m;
+
+public:
+    // The dictionary should hold the strings the messages are likely to share, the most
+    // frequent ones last. The decompressing side needs the same one.
+    explicit Compressor(std::span<const std::byte> dictionary = {});
+    Compressor(const Compressor&) = delete;
+    Compressor& operator=(const Compressor&) = delete;
+    ~Compressor();
+
+    // Appends the compressed bytes to out. Returns false, leaving out as it was, if they
+    // wouldn't be shorter than in.
+    bool compress(std::span<const std::byte> in, std::vector<std::byte>& out);
+};
+
+class Decompressor {
+private:
+    struct Private;
+    std::unique_ptr<Private> m;
+
+public:
+    explicit Decompressor(std::span<const std::byte> dictionary = {});
+    Decompressor(const Decompressor&) = delete;
+    Decompressor& operator=(const Decompressor&) = delete;
+    ~Decompressor();
+
+    // Replaces what out holds with the decompressed bytes, reusing its storage. Returns false
+    // if the bytes are not valid, or would decompress to more than max_size.
+    bool decompress(std::span<const std::byte> in, std::size_t max_size, std::string& out);
+};
+
+// The dictionary of compressed frames: the text the server repeats the most.
+extern const std::string_view dictionary;
+
+// Bodies shorter than this are not worth compressing.
+constexpr std::size_t min_compress_size = 16;
+
+// Compresses the body of a frame, as in Compressor::compress(), with the dictionary of the
+// protocol and a compressor kept by the calling thread.
+bool compress(std::span<const std::byte> in, std::vector<std::byte>& out);
+// Decompresses the body of a frame the same way.
+bool decompress(std::span<const std::byte> in, std::string& out);
+
+// Encodes a message straight into a buffer, without building its body separately first:
+// room for the header is reserved up front, and finish() fills it in.
+class Writer {
+private:
+    std::vector<std::byte>& m_buf;
+    // Where the room for the header starts.
+    std::size_t m_start;
+
+public:
+    // Appends to what the buffer already holds.
+    explicit Writer(std::vector<std::byte>& buf);
+
+    Writer& operator<<(std::string_view s);
+    Writer& operator<<(char c);
+
+    // Appends n bytes for the caller to write, which stay valid until the buffer is modified.
+    std::span<std::byte> extend(std::size_t n);
+
+    // The bytes written so far.
+    std::span<const std::byte> body() const noexcept;
+
+    // Returns the encoded message, which stays valid until the buffer is modified.
+    std::span<const std::byte>
+    finish(Version version, FrameType type = FrameType::Data) noexcept;
+};
+
+// Splits a stream of bytes into messages, whatever way the stream was chunked. Received
+// bytes are appended to buffer(), after which next() is called until it reports that more
+// data is needed. A partially received message is kept across calls.
+class Decoder {
+private:
+    std::vector<std::byte> m_buf;
+    // Start of the bytes not yet decoded.
+    std::size_t m_pos = 0;
+    // Unknown until the first bytes tell whether they are a hello.
+    std::optional<Version> m_version;
+    // What the peer asked for in its hello, if it sent one.
+    std::optional<Encoding> m_hello;
+    // Type and length of the frame being received, once its header was decoded.
+    FrameType m_type = FrameType::Data;
+    bool m_is_compressed = false;
+    std::optional<std::size_t> m_body_len;
+    // The last compressed message, once decompressed.
+    std::string m_inflated;
+    // Bytes left in the batch being received, if any.
+    std::optional<std::size_t> m_batch_left;
+    // Whether chunks of a message were received, but not its last piece.
+    bool m_is_in_message = false;
+
+public:
+    enum class Status {
+        // A message was decoded, or the last piece of one sent in chunks.
+        Message,
+        // A piece of a message sent in chunks, which the next Chunk or Message goes on with.
+        Chunk,
+        // The peer sent a hello, what it asks for is returned by hello().
+        Hello,
+        // The peer is leaving.
+        Disconnect,
+        // The peer sent a ping.
+        Ping,
+        // A header was received but it is not valid.
+        Invalid,
+        // No complete message is buffered.
+        Incomplete,
+    };
+
+    struct Result {
+        Status status;
+        // Points into the decoder rather than being copied out of it, so it is only valid
+        // until next() or buffer() is called again.
+        std::string_view message;
+        // Whether the Chunk or Message goes on with a message started by earlier chunks.
+        bool is_continuation = false;
+    };
+
+    // Detects the version from the first bytes, as a server does.
+    Decoder() = default;
+    explicit Decoder(Version version) : m_version(version) {}
+
+    // Drops the bytes decoded so far, before more are appended.
+    std::vector<std::byte>& buffer() noexcept;
+
+    // The version the peer sends in, once known.
+    std::optional<Version> version() const noexcept { return m_version; }
+    std::optional<Encoding> hello() const noexcept { return m_hello; }
+
+    Result next();
+};
 } // namespace proto
 
-#endif // TERMCHAT_PROTOCOL_H
\ No newline at end of file
+#endif // TERMCHAT_PROTOCOL_H
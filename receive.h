@@ -2,6 +2,9 @@
 #define TERMCHAT_RECEIVE_H
 
 #include <cstddef>
+#include <cstdint>
+#include <optional>
+#include <string>
 #include <vector>
 
 #include "protocol.h"
@@ -10,25 +13,108 @@
 struct ReceiveResult {
     std::optional<std::string> message;
     bool is_connected;
+    // Set if the server answered a hello, to what it picked.
+    std::optional<proto::Encoding> encoding = std::nullopt;
 };
 
-inline ReceiveResult receive(Receiver& r, std::vector<std::byte>& buf) {
-    buf.resize(proto::header_size);
-    if (!r.recv(buf)) {
-        return {.is_connected = false};
+// Receives exactly n bytes, appending them to buf.
+inline bool receive_exactly(Receiver& r, std::vector<std::byte>& buf, std::size_t n) {
+    std::vector<std::byte> part(n);
+    if (!r.recv(part)) {
+        return false;
     }
+    buf.insert(buf.end(), part.begin(), part.end());
+    return true;
+}
 
-    const auto maybe_len = proto::unpack_header(buf);
-    if (!maybe_len.has_value()) {
-        return {.is_connected = true};
-    }
+// Receives the next message, sent in the given version of the protocol.
+inline ReceiveResult
+receive(Receiver& r, std::vector<std::byte>& buf, proto::Version version) {
+    for (;;) {
+        buf.clear();
+        if (!receive_exactly(r, buf, 1)) {
+            return {.is_connected = false};
+        }
 
-    buf.resize(*maybe_len);
-    if (!r.recv(buf)) {
-        return {.is_connected = false};
-    }
+        if (version == proto::Version::V1) {
+            if (buf[0] == proto::hello_magic[0]) {
+                if (!receive_exactly(r, buf, proto::hello_size - 1)) {
+                    return {.is_connected = false};
+                }
+                return {
+                    .is_connected = true,
+                    .encoding = proto::read_hello(std::span(buf).first<proto::hello_size>()),
+                };
+            }
+
+            if (!receive_exactly(r, buf, proto::header_size - 1)) {
+                return {.is_connected = false};
+            }
+            const auto maybe_len = proto::unpack_header(buf);
+            if (!maybe_len.has_value()) {
+                return {.is_connected = true};
+            }
+
+            buf.clear();
+            if (!receive_exactly(r, buf, *maybe_len)) {
+                return {.is_connected = false};
+            }
+            return {.message = proto::unpack(buf, *maybe_len), .is_connected = true};
+        }
 
-    return {.is_connected = true, .message = proto::unpack(buf, *maybe_len)};
+        const auto type_byte = std::to_integer<std::uint8_t>(buf[0]);
+        const auto type = proto::FrameType(type_byte & ~proto::compressed_flag);
+        const bool is_compressed = (type_byte & proto::compressed_flag) != 0;
+        std::uint64_t len = 0;
+        for (std::size_t shift = 0;; shift += 7) {
+            buf.clear();
+            if (!receive_exactly(r, buf, 1)) {
+                return {.is_connected = false};
+            }
+            const auto b = std::to_integer<std::uint64_t>(buf[0]);
+            len |= (b & 0x7f) << shift;
+            if ((b & 0x80) == 0) {
+                break;
+            }
+            if (shift >= 56) {
+                return {.is_connected = true};
+            }
+        }
+
+        if (type == proto::FrameType::Batch) {
+            // Its frames follow.
+            continue;
+        }
+        if (len > proto::max_body_size) {
+            return {.is_connected = true};
+        }
+
+        buf.clear();
+        if (!receive_exactly(r, buf, len)) {
+            return {.is_connected = false};
+        }
+
+        switch (type) {
+        // The pieces of a long message are shown as they come, like messages of their own.
+        case proto::FrameType::Chunk:
+        case proto::FrameType::Data: {
+            if (!is_compressed) {
+                return {.message = proto::unpack(buf, len), .is_connected = true};
+            }
+            std::string message;
+            if (!proto::decompress(buf, message)) {
+                return {.is_connected = true};
+            }
+            return {.message = std::move(message), .is_connected = true};
+        }
+        case proto::FrameType::Disconnect:
+            return {.is_connected = false};
+        case proto::FrameType::Ping:
+            continue;
+        default:
+            return {.is_connected = true};
+        }
+    }
 }
 
-#endif // TERMCHAT_RECEIVE_H
\ No newline at end of file
+#endif // TERMCHAT_RECEIVE_H
@@ -0,0 +1,93 @@
+#ifndef TERMCHAT_RING_H
+#define TERMCHAT_RING_H
+
+#include <atomic>
+#include <bit>
+#include <cstddef>
+#include <memory>
+#include <optional>
+#include <utility>
+
+// A bounded queue between exactly one producer thread and one consumer thread, without locks.
+// Each side only writes its own index, and reads the other one's only when its cached copy
+// says the ring is full (or empty), so in the common case they don't share a cache line.
+// T must be default constructible: popped slots are left in a moved-from state.
+template <class T> class SpscRing {
+private:
+    static constexpr std::size_t cache_line = 64;
+
+    std::unique_ptr<T[]> m_slots;
+    // The capacity is a power of two, so that positions are mapped to slots with a mask.
+    std::size_t m_mask;
+
+    // Position of the next slot to push to, written by the producer.
+    alignas(cache_line) std::atomic<std::size_t> m_tail = 0;
+    // The producer's copy of m_head.
+    std::size_t m_head_cache = 0;
+
+    // Position of the next slot to pop from, written by the consumer.
+    alignas(cache_line) std::atomic<std::size_t> m_head = 0;
+    // The consumer's copy of m_tail.
+    std::size_t m_tail_cache = 0;
+
+public:
+    // The capacity is rounded up to a power of two.
+    explicit SpscRing(std::size_t capacity)
+        : m_slots(std::make_unique<T[]>(std::bit_ceil(capacity))),
+          m_mask(std::bit_ceil(capacity) - 1) {}
+
+    SpscRing(const SpscRing&) = delete;
+    SpscRing& operator=(const SpscRing&) = delete;
+
+    std::size_t capacity() const noexcept { return m_mask + 1; }
+
+    // Producer only. Returns false, leaving the value untouched, if the ring is full.
+    bool try_push(T&& value) {
+        const auto tail = m_tail.load(std::memory_order_relaxed);
+        if (tail - m_head_cache > m_mask) {
+            m_head_cache = m_head.load(std::memory_order_acquire);
+            if (tail - m_head_cache > m_mask) {
+                return false;
+            }
+        }
+
+        m_slots[tail & m_mask] = std::move(value);
+        m_tail.store(tail + 1, std::memory_order_release);
+        return true;
+    }
+
+    // Producer only.
+    bool full() noexcept {
+        const auto tail = m_tail.load(std::memory_order_relaxed);
+        if (tail - m_head_cache > m_mask) {
+            m_head_cache = m_head.load(std::memory_order_acquire);
+        }
+        return tail - m_head_cache > m_mask;
+    }
+
+    // Consumer only.
+    std::optional<T> try_pop() {
+        const auto head = m_head.load(std::memory_order_relaxed);
+        if (head == m_tail_cache) {
+            m_tail_cache = m_tail.load(std::memory_order_acquire);
+            if (head == m_tail_cache) {
+                return std::nullopt;
+            }
+        }
+
+        std::optional<T> value(std::move(m_slots[head & m_mask]));
+        m_head.store(head + 1, std::memory_order_release);
+        return value;
+    }
+
+    // Consumer only.
+    bool empty() noexcept {
+        const auto head = m_head.load(std::memory_order_relaxed);
+        if (head == m_tail_cache) {
+            m_tail_cache = m_tail.load(std::memory_order_acquire);
+        }
+        return head == m_tail_cache;
+    }
+};
+
+#endif // TERMCHAT_RING_H
@@ -1,399 +1,1412 @@
 #include <algorithm>
-#include <cctype>
+#include <array>
+#include <atomic>
+#include <chrono>
 #include <cstddef>
+#include <csignal>
+#include <cstdint>
+#include <cstdlib>
+#include <deque>
+#include <functional>
 #include <exception>
+#include <fstream>
 #include <iostream>
+#include <memory>
+#include <memory_resource>
 #include <optional>
-#include <sstream>
+#include <span>
 #include <stdexcept>
 #include <string>
 #include <string_view>
-#include <unordered_map>
+#include <thread>
 #include <utility>
 #include <vector>
 
+#include "chat.h"
+#include "history.h"
+#include "mailbox.h"
+#include "metrics.h"
 #include "protocol.h"
-#include "receive.h"
+#include "ring.h"
+#include "slotmap.h"
 #include "socket.h"
+#include "timer_wheel.h"
+#include "trace.h"
+
+// The messages which never change, encoded once: sending one only shares its bytes.
+struct Replies {
+    Encoded prompt = encode("> ");
+    Encoded welcome = encode("Hi there! Please give us your username.\n> ");
+    Encoded invalid_user_name = encode("That's not a valid user name. Try again!\n> ");
+    Encoded taken_user_name = encode("This user name is taken. Try again!\n> ");
+    Encoded empty_message = encode("Can't send empty message. Try again!\n> ");
+    Encoded invalid_recipient = encode("Invalid user name. Try again!\n> ");
+    Encoded unknown_recipient = encode("This user doesn't exist. Misspelled?\n> ");
+    Encoded invalid_message = encode("I couldn't quite get that. Can you say it again?\n> ");
+    Encoded invalid_channel = encode("That's not a valid channel name. Try again!\n> ");
+    Encoded not_in_channel =
+        encode("You are not in this channel. Join it with \"/join #<channel>\" first!\n> ");
+    Encoded already_in_channel = encode("You are in this channel already.\n> ");
+    Encoded too_many_channels = encode("You are in too many channels. Leave one first!\n> ");
+    Encoded pong = encode({}, false, proto::FrameType::Ping);
+};
 
-class Username {
-private:
-    std::string value;
+static const Replies replies;
+
+// A rendered message on its way to the clients of a shard. Without a recipient, it goes to
+// all the registered clients of the shard but the omitted one, or to the members of the
+// channel only if there is one.
+struct Envelope {
+    std::optional<Registry::Handle> to;
+    std::optional<Registry::Handle> omit;
+    std::optional<ChannelName> channel;
+    Encoded frame;
+    // Switches the recipient to this encoding once the frame is sent.
+    std::optional<proto::Encoding> encoding;
+};
 
-    explicit Username(std::string_view s) : value(s) {}
+// The text to render for a message a client sent, or for a change of its state. Everything a
+// client causes to be sent goes through one job after the other, in order.
+struct Job {
+    enum class Kind {
+        // Sends reply to the client.
+        Reply,
+        // Welcomes the client and announces it to everyone else.
+        Registered,
+        // Announces that the client is gone.
+        Left,
+        // Sends text to everyone else.
+        Broadcast,
+        // Sends text to the client at `to`.
+        Private,
+        // Announces that the client joined the channel, or left it.
+        Joined,
+        Parted,
+        // Sends text to the other members of the channel.
+        ToChannel,
+    };
+
+    Kind kind = Kind::Reply;
+    Location from{};
+    // The user name of the client, unless it is not registered.
+    Username user_name;
+    Encoded reply;
+    // For a reply: the encoding the client is switched to once it is sent.
+    std::optional<proto::Encoding> encoding;
+    // Points into the receive buffer of the client while the job is rendered right away, and
+    // to text_storage once it is handed to a worker.
+    std::string_view text;
+    std::unique_ptr<char[]> text_storage;
+    Location to{};
+    ChannelName channel;
+    bool is_unexpected = false;
+
+    // Which part of the message the text is, for one sent in chunks.
+    enum class Piece { Whole, First, Middle, Last };
+    Piece piece = Piece::Whole;
+};
 
-public:
-    static std::optional<Username> parse(std::string_view s) {
-        // User names should be of the form [a-z0-9-_]{3,30}.
-        if (s.size() < 3 || s.size() > 30) {
-            return std::nullopt;
+// Renders the job and passes each resulting envelope to send, along with the index of the
+// shard it is for. Touches no state but the directory and the history, if there is one, so
+// it can run on any thread.
+// Messages are written into buf, which is reused from one to the next, and anything else
+// render() needs for a while is taken from scratch, so that the only allocation is the frame
+// holding their encodings. They are compressed too if should_compress.
+template <class Send>
+static void render(
+    const Job& job, Directory& directory, History* history, std::size_t shard_count,
+    bool should_compress, std::vector<std::byte>& buf, std::pmr::memory_resource* scratch,
+    Send&& send) {
+    const trace::Span span("render");
+    const auto to_sender = [&](Encoded frame) {
+        send(
+            job.from.shard,
+            Envelope{.to = job.from.client, .omit = std::nullopt, .frame = std::move(frame)});
+    };
+    // Encoded once, shared by the queues of all the recipients, on all the shards.
+    const auto to_all_but_sender = [&](const Encoded& frame) {
+        for (std::size_t i = 0; i < shard_count; ++i) {
+            const auto omit =
+                i == job.from.shard ? std::optional(job.from.client) : std::nullopt;
+            send(i, Envelope{.to = std::nullopt, .omit = omit, .frame = frame});
         }
-        const auto pos_invalid = std::find_if(s.begin(), s.end(), [](int c) {
-            return !(islower(c) || isdigit(c) || c == '-' || c == '_');
-        });
-        if (pos_invalid != s.end()) {
-            return std::nullopt;
+    };
+    const auto to_channel_but_sender = [&](const Encoded& frame) {
+        for (std::size_t i = 0; i < shard_count; ++i) {
+            const auto omit =
+                i == job.from.shard ? std::optional(job.from.client) : std::nullopt;
+            send(
+                i,
+                Envelope{.to = std::nullopt, .omit = omit, .channel = job.channel, .frame = frame});
         }
-        // User name also can't be "bc" but that case is handled by the length check.
-        return Username(s);
+    };
+
+    // Starts a message, replacing the previous one.
+    const auto message = [&] {
+        buf.clear();
+        return proto::Writer(buf);
+    };
+
+    // The pieces of a message sent in chunks are rendered one by one, each with a header of its
+    // own so that it reads well even if other messages come in between. Only the last one
+    // ends with the prompt.
+    const bool is_continued = job.piece == Job::Piece::Middle || job.piece == Job::Piece::Last;
+    const bool is_finished = job.piece == Job::Piece::Whole || job.piece == Job::Piece::Last;
+    const std::string_view continued = is_continued ? " (continued)" : "";
+    const std::string_view ending = is_finished ? "\n> " : "";
+    auto text = job.text;
+    if (!is_finished && text.ends_with('\n')) {
+        // The header of the next piece starts a new line anyway.
+        text.remove_suffix(1);
     }
 
-    operator std::string_view() const noexcept { return value; }
-};
-
-class Registry {
-private:
-    // INVARIANTS:
-    // 1. All information in id_to_user_name and user_name_to_client must correspond to a client
-    // inside m_clients.
-    // 2. user_name_to_client contains views of Usernames inside id_to_user_name. Handle with care
-    // to not reference invalid memory.
-    // 3. Unregistered clients do not have any information in id_to_user_name or
-    // user_name_to_client.
-    //
-    // Note: we do linear searches on m_clients. This should not be a performance issue for our
-    // use case, given that it is not expected to have a lot of clients, and makes working with
-    // the server abstraction easier and more performant – if we were to store it in a map,
-    // we'd have to construct a vector for each call to poll().
-
-    std::vector<ServerClient> m_clients;
-    std::unordered_map<ServerClient::ID, Username> id_to_user_name;
-    std::unordered_map<std::string_view, ServerClient> user_name_to_client;
-
-    auto find_by_id(ServerClient::ID id) const noexcept {
-        return std::find_if(m_clients.begin(), m_clients.end(), [id](const ServerClient& c) {
-            return c.id() == id;
-        });
-    }
+    switch (job.kind) {
+    case Job::Kind::Reply:
+        send(
+            job.from.shard,
+            Envelope{
+                .to = job.from.client,
+                .omit = std::nullopt,
+                .frame = job.reply,
+                .encoding = job.encoding,
+            });
+        break;
+
+    case Job::Kind::Registered: {
+        auto out = message();
+        out << "Registered!\nCurrently active users:\n";
+
+        for (const auto& user_name : directory.user_names(scratch)) {
+            out << " - " << user_name;
+            if (user_name == std::string_view(job.user_name)) {
+                out << " (you)";
+            }
+            out << '\n';
+        }
 
-public:
-    void add_unregistered(ServerClient client) {
-        const auto it = find_by_id(client.id());
-        if (it != m_clients.end()) {
-            throw std::logic_error("tried to add already added client");
+        out << "To send a message to someone, type \"<username> <your message>\"\n"
+               "To send a message to everyone, type \"bc <your message>\"\n"
+               "To talk in a channel, type \"/join #<channel>\", then \"#<channel> <your "
+               "message>\"\n"
+               "Happy chatting!\n\n"
+               "> ";
+        to_sender(encode(out.body(), should_compress));
+        if (history != nullptr) {
+            // Straight from the log, in whatever encodings the messages were sent.
+            history->replay(scratch, to_sender);
         }
 
-        m_clients.push_back(client);
+        auto announcement = message();
+        announcement << '\n' << job.user_name << " is here!\n> ";
+        to_all_but_sender(encode(announcement.body(), should_compress));
+        break;
     }
 
-    bool is_registered(ServerClient::ID id) { return id_to_user_name.contains(id); }
-
-    std::optional<std::reference_wrapper<Username>> get_user_name(ServerClient::ID id) {
-        const auto it = id_to_user_name.find(id);
-        if (it == id_to_user_name.end()) {
-            return std::nullopt;
-        }
-        return it->second;
+    case Job::Kind::Left: {
+        auto out = message();
+        out << '\n'
+            << job.user_name << " has " << (job.is_unexpected ? "been disconnected" : "left")
+            << ".\n> ";
+        to_all_but_sender(encode(out.body(), should_compress));
+        break;
     }
 
-    std::optional<ServerClient> get_client(const Username& user_name) {
-        const auto it = user_name_to_client.find(user_name);
-        if (it == user_name_to_client.end()) {
-            return std::nullopt;
+    case Job::Kind::Broadcast: {
+        auto out = message();
+        out << '\n'
+            << job.user_name << " to everyone" << continued << ":\n"
+            << indent(text) << ending;
+        const auto frame = encode(out.body(), should_compress);
+        to_all_but_sender(frame);
+        if (is_finished) {
+            to_sender(replies.prompt);
+        }
+        if (history != nullptr) {
+            history->append(frame);
         }
-        return it->second;
+        break;
     }
 
-    bool register_client(ServerClient::ID id, Username user_name) {
-        if (user_name_to_client.contains(user_name)) {
-            return false;
-        }
+    case Job::Kind::Private: {
+        const bool is_to_self = job.to.shard == job.from.shard && job.to.client == job.from.client;
 
-        const auto it = find_by_id(id);
-        if (it == m_clients.end() || is_registered(it->id())) {
-            throw std::logic_error("tried to register inexistent or already registered client");
+        auto out = message();
+        out << '\n';
+        if (is_to_self) {
+            out << "Note to self" << continued << ':';
+        } else {
+            out << job.user_name << " to you" << continued << ':';
         }
+        out << '\n' << indent(text) << ending;
+
+        send(
+            job.to.shard,
+            Envelope{
+                .to = job.to.client,
+                .omit = std::nullopt,
+                .frame = encode(out.body(), should_compress),
+            });
+        if (!is_to_self && is_finished) {
+            to_sender(replies.prompt);
+        }
+        break;
+    }
 
-        id_to_user_name.emplace(std::make_pair(id, std::move(user_name)));
-        user_name_to_client[id_to_user_name.at(id)] = *it;
-
-        return true;
+    case Job::Kind::Joined:
+    case Job::Kind::Parted: {
+        const bool has_joined = job.kind == Job::Kind::Joined;
+        auto out = message();
+        out << "You " << (has_joined ? "joined" : "left") << " #" << job.channel << ".\n> ";
+        to_sender(encode(out.body(), should_compress));
+
+        auto announcement = message();
+        announcement << '\n'
+                     << job.user_name << (has_joined ? " joined" : " left") << " #"
+                     << job.channel << ".\n> ";
+        to_channel_but_sender(encode(announcement.body(), should_compress));
+        break;
     }
 
-    void remove(ServerClient::ID id) {
-        const auto it = find_by_id(id);
-        if (it == m_clients.end()) {
-            throw std::logic_error("tried to remove inexistent client");
+    case Job::Kind::ToChannel: {
+        auto out = message();
+        out << '\n'
+            << job.user_name << " to #" << job.channel << continued << ":\n"
+            << indent(text) << ending;
+        to_channel_but_sender(encode(out.body(), should_compress));
+        if (is_finished) {
+            to_sender(replies.prompt);
         }
+        break;
+    }
+    }
+}
 
-        const auto c = *it;
+// Lets producers wake up a consumer only if it might be waiting for them. The consumer calls
+// idle() before its last check for work and busy() once it's back at it; a producer calls
+// should_wake() after making work available.
+class IdleFlag {
+private:
+    std::atomic<bool> m_is_idle = false;
 
-        m_clients.erase(it);
+public:
+    void idle() noexcept {
+        m_is_idle.store(true, std::memory_order_relaxed);
+        // Orders the store before the loads of the consumer's final check.
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+    }
 
-        if (!is_registered(id)) {
-            return;
-        }
+    void busy() noexcept { m_is_idle.store(false, std::memory_order_relaxed); }
 
-        const auto& user_name = id_to_user_name.at(id);
-        user_name_to_client.erase(user_name);
-        id_to_user_name.erase(id);
+    bool should_wake() noexcept {
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        return m_is_idle.exchange(false, std::memory_order_relaxed);
     }
 
-    std::span<ServerClient> clients() noexcept { return m_clients; }
+    // Blocks until a producer wakes the consumer up.
+    void wait() noexcept { m_is_idle.wait(true, std::memory_order_relaxed); }
+    void notify() noexcept { m_is_idle.notify_one(); }
 };
 
-static void send_to_all_registered_except(
-    Registry&, ServerClient::ID, std::string_view, std::vector<std::byte>&);
+// Memory for what a thread only needs while handling one batch of work, released all at once
+// when the batch is done. Allocating from it is a pointer bump, and it only falls back to the
+// global allocator for a batch which outgrows its buffer.
+class Scratch {
+private:
+    std::array<std::byte, 64 * 1024> m_buffer;
+    std::pmr::monotonic_buffer_resource m_resource{m_buffer.data(), m_buffer.size()};
 
-static void remove_and_broadcast(
-    ServerClient::ID to_remove, Registry& reg, bool is_unexpected, std::vector<std::byte>& buf) {
-    const auto user_name = reg.get_user_name(to_remove);
-    if (!user_name.has_value()) {
-        // No need to announce if the client was not registered, as no clients can communicate with
-        // it.
-        return;
-    }
+public:
+    std::pmr::memory_resource* get() noexcept { return &m_resource; }
+    // Invalidates everything allocated since the last release.
+    void release() noexcept { m_resource.release(); }
+};
 
-    std::ostringstream out;
-    out << "\n"
-        << std::string_view(user_name->get()) << " has "
-        << (is_unexpected ? "been disconnected" : "left") << ".\n> ";
+// What a shard counts, read by the admin thread while the shard writes it.
+struct Metrics {
+    // Events per poll.
+    using ReadyHistogram = Histogram<0, 11>;
+    // Nanoseconds, from about a microsecond to a second.
+    using TimeHistogram = Histogram<10, 21>;
+
+    Counter accepted;
+    Counter closed;
+    Counter registered;
+    Counter deregistered;
+    // Decoded frames, and the bytes they were received in.
+    Counter messages_in;
+    Counter bytes_in;
+    // Frames queued to clients, and their bytes.
+    Counter messages_out;
+    Counter bytes_out;
+    Counter send_failures;
+    // Registered clients which said they were leaving, and those which were disconnected.
+    Counter left;
+    Counter disconnected;
+    // Clients removed for staying quiet for too long, and pings sent to quiet clients.
+    Counter timeouts;
+    Counter pings;
+    Counter polls;
+    ReadyHistogram ready;
+    // Times are taken per poll rather than per event, to keep clock reads off the handlers.
+    // From the return of a poll to the start of the next one.
+    TimeHistogram iteration_ns;
+    // The part spent on the clients the poll returned.
+    TimeHistogram handler_ns;
+};
 
-    send_to_all_registered_except(reg, to_remove, out.str(), buf);
+// Capacity of each ring between a shard and a worker.
+constexpr std::size_t ring_capacity = 1024;
 
-    reg.remove(to_remove);
-}
+struct Shard;
 
-static bool
-send_or_remove(ServerClient& c, Registry& reg, std::string_view msg, std::vector<std::byte>& buf) {
-    buf.resize(0);
-    proto::pack(msg, buf);
+// A thread which renders jobs for all the shards. Each client is pinned to one worker, so that
+// its jobs are rendered, and their results delivered, in order.
+struct Worker {
+    std::size_t index;
+    // One ring per shard.
+    std::vector<std::unique_ptr<SpscRing<Job>>> jobs;
+    IdleFlag idle;
+    // Released after each job.
+    Scratch scratch;
+};
 
-    try {
-        c.send(buf);
-        return true;
-    } catch (const SocketError&) {
-        remove_and_broadcast(c.id(), reg, true, buf);
-        return false;
-    }
-}
+// How long clients may stay quiet, in milliseconds, zero meaning forever.
+struct Timeouts {
+    // From their connection until they pick a user name.
+    std::uint64_t registration = 60'000;
+    // Once registered, before they are disconnected.
+    std::uint64_t idle = 0;
+    // Once registered, before they are sent a ping, and then again at the same interval. Only
+    // clients speaking version 2 can be pinged.
+    std::uint64_t ping = 0;
+};
 
-static void send_to_all_registered_except(
-    Registry& reg, ServerClient::ID omit, std::string_view msg, std::vector<std::byte>& buf) {
-    buf.resize(0);
-    proto::pack(msg, buf);
+struct Cluster {
+    Directory directory;
+    Timeouts timeouts;
+    // Kept only if asked to.
+    std::unique_ptr<History> history;
+    // Connections which asked for compression, which is skipped while there are none.
+    std::atomic<std::size_t> compressing_clients = 0;
 
-    std::vector<ServerClient::ID> failed;
-    for (auto& client : reg.clients()) {
-        if (client.id() == omit || !reg.is_registered(client.id())) {
-            continue;
+    bool should_compress() const noexcept {
+        return compressing_clients.load(std::memory_order_relaxed) > 0;
+    }
+    std::vector<std::unique_ptr<Shard>> shards;
+    // With no workers, jobs are rendered by the shard which produces them.
+    std::vector<std::unique_ptr<Worker>> workers;
+};
+
+// A server with its own listening socket and clients, run by a single thread. Shards only
+// talk to each other through their mailboxes, or through the workers if there are any.
+struct Shard {
+    std::size_t index;
+    Cluster& cluster;
+    Server server;
+    Registry registry;
+    Mailbox<Envelope> mailbox;
+
+    // Rendered messages, one ring per worker.
+    std::vector<std::unique_ptr<SpscRing<Envelope>>> rendered;
+    // Jobs which didn't fit in the ring of their worker, per worker.
+    std::vector<std::deque<Job>> backlog;
+    // Clients whose messages are left undecoded until their worker catches up.
+    std::vector<Registry::Handle> stalled;
+    // Set while there are backlogged jobs or stalled clients, for workers to wake the shard up
+    // once they pop.
+    std::atomic<bool> wants_space = false;
+    IdleFlag idle;
+    // Released after each poll.
+    Scratch scratch;
+    Metrics metrics;
+    // Times are in milliseconds since the shard started, and clients have a timer each while
+    // the timeouts which apply to them are set.
+    std::chrono::steady_clock::time_point started = std::chrono::steady_clock::now();
+    TimerWheel<Registry::Handle> timers;
+    // When the last poll returned.
+    std::uint64_t polled_at = 0;
+
+    Shard(std::size_t index, Cluster& cluster, unsigned short port, const ServerOptions& options)
+        : index(index), cluster(cluster), server(port, options),
+          registry(cluster.directory, index) {}
+
+    // Can be called from any thread.
+    void post(Envelope envelope) {
+        if (mailbox.post(std::move(envelope))) {
+            server.wake();
         }
+    }
 
-        try {
-            client.send(buf);
-        } catch (const SocketError&) {
-            failed.push_back(client.id());
+    // Can be called from any thread.
+    void notify() noexcept {
+        if (idle.should_wake()) {
+            server.wake();
         }
     }
 
-    for (auto id : failed) {
-        remove_and_broadcast(id, reg, true, buf);
+    std::size_t worker_of(Registry::Handle client) const noexcept {
+        return std::hash<std::uint64_t>{}(client.bits()) % cluster.workers.size();
     }
-}
 
-class ServerClientNonBlockGuard {
-private:
-    ServerClient client;
+    std::uint64_t since_started(std::chrono::steady_clock::time_point t) const noexcept {
+        return std::chrono::duration_cast<std::chrono::milliseconds>(t - started).count();
+    }
 
-public:
-    ServerClientNonBlockGuard(ServerClient& c) : client(c) { client.set_blocking(false); }
-    ~ServerClientNonBlockGuard() { client.set_blocking(true); }
-};
+    SpscRing<Job>& jobs_of(std::size_t worker) noexcept {
+        return *cluster.workers[worker]->jobs[index];
+    }
 
-static std::optional<std::string>
-recv_or_remove(ServerClient& client, Registry& reg, std::vector<std::byte>& buf) try {
-    ReceiveResult recv;
-    {
-        ServerClientNonBlockGuard g(client);
-        recv = receive(client, buf);
+    // Whether a job from the client would be taken by its worker right away.
+    bool can_dispatch(Registry::Handle client) noexcept {
+        if (cluster.workers.empty()) {
+            return true;
+        }
+        const auto worker = worker_of(client);
+        return backlog[worker].empty() && !jobs_of(worker).full();
     }
-    if (!recv.is_connected) {
-        remove_and_broadcast(client.id(), reg, true, buf);
-        return std::nullopt;
+};
+
+static void deliver(Shard&, Envelope, std::vector<std::byte>&);
+
+// Hands the job to the worker of the client, or renders it right away if there are no workers.
+static void dispatch(Shard& shard, Job job, std::vector<std::byte>& buf) {
+    const trace::Span span("dispatch");
+    if (shard.cluster.workers.empty()) {
+        render(
+            job, shard.cluster.directory, shard.cluster.history.get(), shard.cluster.shards.size(),
+            shard.cluster.should_compress(), buf, shard.scratch.get(),
+            [&](std::size_t to_shard, Envelope envelope) {
+                if (to_shard == shard.index) {
+                    deliver(shard, std::move(envelope), buf);
+                } else {
+                    shard.cluster.shards[to_shard]->post(std::move(envelope));
+                }
+            });
+        return;
     }
-    if (!recv.message.has_value()) {
-        send_or_remove(client, reg, "I couldn't quite get that. Can you say it again?\n> ", buf);
-        return std::nullopt;
+
+    if (!job.text.empty()) {
+        // The receive buffer is reused before the worker gets to the job.
+        job.text_storage = std::make_unique_for_overwrite<char[]>(job.text.size());
+        std::copy(job.text.begin(), job.text.end(), job.text_storage.get());
+        job.text = std::string_view(job.text_storage.get(), job.text.size());
     }
-    if (recv.message == "") { // disconnect
-        remove_and_broadcast(client.id(), reg, false, buf);
-        return std::nullopt;
+
+    const auto worker = shard.worker_of(job.from.client);
+    if (!shard.backlog[worker].empty() || !shard.jobs_of(worker).try_push(std::move(job))) {
+        shard.backlog[worker].push_back(std::move(job));
+        shard.wants_space.store(true, std::memory_order_relaxed);
+        return;
     }
-    return std::move(recv.message);
-} catch (const SocketError& e) {
-    if (e.would_block()) {
-        return std::nullopt;
+    if (shard.cluster.workers[worker]->idle.should_wake()) {
+        shard.cluster.workers[worker]->idle.notify();
     }
-    throw e;
 }
 
-static void handle_new_client(ServerClient& client, Registry& reg, std::vector<std::byte>& buf) {
-    reg.add_unregistered(client);
-
-    send_or_remove(client, reg, "Hi there! Please give us your username.\n> ", buf);
+static void remove_client(Registry::Handle handle, Shard& shard) {
+    const auto record = shard.registry.find(handle);
+    if (record->encoding.is_compressed) {
+        shard.cluster.compressing_clients.fetch_sub(1, std::memory_order_relaxed);
+    }
+    if (record->user_name.has_value()) {
+        shard.metrics.deregistered.add();
+    }
+    shard.timers.cancel(record->timer);
+    shard.registry.remove(handle);
+    shard.metrics.closed.add();
 }
 
-static void
-handle_unregistered_client_data(ServerClient& client, Registry& reg, std::vector<std::byte>& buf) {
-    auto recv = recv_or_remove(client, reg, buf);
-    if (!recv.has_value()) {
+static void remove_and_broadcast(
+    Registry::Handle to_remove, Shard& shard, bool is_unexpected, std::vector<std::byte>& buf) {
+    auto& reg = shard.registry;
+    if (!reg.contains(to_remove)) {
+        // Already removed while announcing the removal of another client.
         return;
     }
 
-    auto maybe_user_name = Username::parse(*recv);
-    if (!maybe_user_name.has_value()) {
-        send_or_remove(client, reg, "That's not a valid user name. Try again!\n> ", buf);
+    const auto user_name = reg.get_user_name(to_remove);
+    if (!user_name.has_value()) {
+        // No need to announce if the client was not registered, as no clients can communicate with
+        // it.
+        remove_client(to_remove, shard);
         return;
     }
 
-    if (!reg.register_client(client.id(), std::move(*maybe_user_name))) {
-        send_or_remove(client, reg, "This user name is taken. Try again!\n> ", buf);
+    Job job{
+        .kind = Job::Kind::Left,
+        .from = {.shard = shard.index, .client = to_remove},
+        .user_name = user_name->get(),
+        .is_unexpected = is_unexpected,
+    };
+    remove_client(to_remove, shard);
+    (is_unexpected ? shard.metrics.disconnected : shard.metrics.left).add();
+
+    dispatch(shard, std::move(job), buf);
+}
+
+static bool send_or_remove(
+    Registry::Handle to, Shard& shard, const Encoded& frame,
+    std::optional<proto::Encoding> encoding, std::vector<std::byte>& buf) {
+    const trace::Span span("send");
+    const auto record = shard.registry.find(to);
+    if (record == nullptr) {
+        // Left after the message was rendered.
+        return false;
+    }
+
+    const auto& bytes = frame.in(record->encoding);
+    if (record->client.try_send(bytes).ok()) {
+        shard.metrics.messages_out.add();
+        shard.metrics.bytes_out.add(bytes.size());
+        if (encoding.has_value()) {
+            if (encoding->is_compressed && !record->encoding.is_compressed) {
+                shard.cluster.compressing_clients.fetch_add(1, std::memory_order_relaxed);
+            }
+            record->encoding = *encoding;
+        }
+        return true;
+    }
+    shard.metrics.send_failures.add();
+    remove_and_broadcast(to, shard, true, buf);
+    return false;
+}
+
+// Sends to the registered clients of this shard only, or to those in the channel if there is
+// one.
+static void send_to_local_registered_except(
+    Shard& shard, std::optional<Registry::Handle> omit, const std::optional<ChannelName>& channel,
+    const Encoded& frame, std::vector<std::byte>& buf) {
+    const trace::Span span("broadcast");
+    std::pmr::vector<Registry::Handle> failed(shard.scratch.get());
+    const auto sent =
+        channel.has_value()
+            ? shard.registry.send_to_channel_except(*channel, omit, frame, failed)
+            : shard.registry.send_to_registered_except(omit, frame, failed);
+    shard.metrics.messages_out.add(sent.messages);
+    shard.metrics.bytes_out.add(sent.bytes);
+    shard.metrics.send_failures.add(failed.size());
+
+    for (auto handle : failed) {
+        remove_and_broadcast(handle, shard, true, buf);
+    }
+}
+
+static void deliver(Shard& shard, Envelope envelope, std::vector<std::byte>& buf) {
+    if (!envelope.to.has_value()) {
+        send_to_local_registered_except(
+            shard, envelope.omit, envelope.channel, envelope.frame, buf);
         return;
     }
 
-    std::ostringstream out;
-    out << "Registered!\nCurrently active users:\n";
+    send_or_remove(*envelope.to, shard, envelope.frame, envelope.encoding, buf);
+}
 
-    for (const auto& c : reg.clients()) {
-        const auto user_name = reg.get_user_name(c.id());
-        if (!user_name.has_value()) {
-            continue;
-        }
+static void reply(
+    Registry::Handle client, Shard& shard, const Encoded& msg, std::vector<std::byte>& buf,
+    std::optional<proto::Encoding> encoding = std::nullopt) {
+    dispatch(
+        shard,
+        Job{
+            .kind = Job::Kind::Reply,
+            .from = {.shard = shard.index, .client = client},
+            .reply = msg,
+            .encoding = encoding,
+        },
+        buf);
+}
 
-        out << " - " << std::string_view(user_name->get());
-        if (c.id() == client.id()) {
-            out << " (you)";
-        }
-        out << '\n';
+static void handle_new_client(ServerClient& client, Shard& shard, std::vector<std::byte>& buf) {
+    const trace::Span span("accept");
+    const auto handle = shard.registry.add_unregistered(client);
+    shard.metrics.accepted.add();
+    const auto record = shard.registry.find(handle);
+    record->heard_at = shard.polled_at;
+    if (const auto timeout = shard.cluster.timeouts.registration; timeout != 0) {
+        record->timer = shard.timers.arm(shard.polled_at + timeout, handle);
     }
 
-    out << "To send a message to someone, type \"<username> <your message>\"\n"
-           "To send a message to everyone, type \"bc <your message>\"\n"
-           "Happy chatting!\n\n"
-           "> ";
+    reply(handle, shard, replies.welcome, buf);
+}
+
+static void handle_unregistered_client_data(
+    Registry::Handle client, Shard& shard, std::string_view recv, std::vector<std::byte>& buf) {
+    auto& reg = shard.registry;
 
-    if (!send_or_remove(client, reg, out.str(), buf)) {
+    auto maybe_user_name = Username::parse(recv);
+    if (!maybe_user_name.has_value()) {
+        reply(client, shard, replies.invalid_user_name, buf);
         return;
     }
 
-    out.str("");
-    out << '\n' << std::string_view(reg.get_user_name(client.id())->get()) << " is here!\n> ";
+    if (!reg.register_client(client, std::move(*maybe_user_name))) {
+        reply(client, shard, replies.taken_user_name, buf);
+        return;
+    }
+    shard.metrics.registered.add();
+
+    // The registration deadline makes way for the idle timeout and the pings.
+    const auto record = reg.find(client);
+    shard.timers.cancel(record->timer);
+    record->timer = {};
+    const auto& timeouts = shard.cluster.timeouts;
+    if (timeouts.idle != 0 || timeouts.ping != 0) {
+        const auto first = timeouts.idle == 0   ? timeouts.ping
+                           : timeouts.ping == 0 ? timeouts.idle
+                                                : std::min(timeouts.idle, timeouts.ping);
+        record->timer = shard.timers.arm(record->heard_at + first, client);
+    }
 
-    send_to_all_registered_except(reg, client.id(), out.str(), buf);
+    dispatch(
+        shard,
+        Job{
+            .kind = Job::Kind::Registered,
+            .from = {.shard = shard.index, .client = client},
+            .user_name = reg.get_user_name(client)->get(),
+        },
+        buf);
 }
 
-class indent {
-private:
-    std::string_view s;
+// Handles a message, or the first piece of one sent in chunks, which decides where the rest
+// goes.
+static void handle_registered_client_data(
+    Registry::Handle client, Shard& shard, std::string_view recv, Job::Piece piece,
+    std::vector<std::byte>& buf) {
+    if (piece == Job::Piece::First) {
+        // Unless it turns out to be valid.
+        shard.registry.find(client)->stream = ClientRecord::Stream{};
+    }
 
-public:
-    explicit indent(std::string_view s) : s(s) {}
-    friend std::ostream& operator<<(std::ostream& os, const indent& i) {
-        std::string_view s = i.s;
+    const auto pos_blank = recv.find(' ');
+    if (pos_blank == std::string_view::npos) {
+        reply(client, shard, replies.empty_message, buf);
+        return;
+    }
+
+    const auto user_name_in = recv.substr(0, pos_blank);
+
+    Job job{
+        .from = {.shard = shard.index, .client = client},
+        .user_name = shard.registry.get_user_name(client)->get(),
+    };
 
-        for (std::size_t pos_lf; (pos_lf = s.find('\n')) != std::string::npos;) {
-            os << "  " << s.substr(0, pos_lf + 1);
-            s = s.substr(pos_lf + 1);
+    if (user_name_in == "/join" || user_name_in == "/leave") {
+        const auto channel = parse_channel_name(recv.substr(pos_blank + 1));
+        if (!channel.has_value()) {
+            reply(client, shard, replies.invalid_channel, buf);
+            return;
         }
 
-        return os << "  " << s;
+        if (user_name_in == "/leave") {
+            if (!shard.registry.leave(client, *channel)) {
+                reply(client, shard, replies.not_in_channel, buf);
+                return;
+            }
+            job.kind = Job::Kind::Parted;
+        } else if (shard.registry.is_member(client, *channel)) {
+            reply(client, shard, replies.already_in_channel, buf);
+            return;
+        } else if (!shard.registry.join(client, *channel)) {
+            reply(client, shard, replies.too_many_channels, buf);
+            return;
+        } else {
+            job.kind = Job::Kind::Joined;
+        }
+        job.channel = *channel;
+        dispatch(shard, std::move(job), buf);
+        return;
     }
-};
 
-static void handle_broadcast(
-    ServerClient& from, Registry& reg, std::string_view msg, std::vector<std::byte>& buf) {
-    const auto user_name = reg.get_user_name(from.id());
+    if (user_name_in == "bc") {
+        job.kind = Job::Kind::Broadcast;
+    } else if (user_name_in.starts_with('#')) {
+        const auto channel = parse_channel_name(user_name_in);
+        if (!channel.has_value()) {
+            reply(client, shard, replies.invalid_channel, buf);
+            return;
+        }
+        if (!shard.registry.is_member(client, *channel)) {
+            reply(client, shard, replies.not_in_channel, buf);
+            return;
+        }
+        job.kind = Job::Kind::ToChannel;
+        job.channel = *channel;
+    } else {
+        const auto maybe_user_name = Username::parse(user_name_in);
+        if (!maybe_user_name.has_value()) {
+            reply(client, shard, replies.invalid_recipient, buf);
+            return;
+        }
+
+        const auto maybe_to = shard.registry.locate(*maybe_user_name);
+        if (!maybe_to.has_value()) {
+            reply(client, shard, replies.unknown_recipient, buf);
+            return;
+        }
 
-    std::ostringstream out;
-    out << '\n' << std::string_view(user_name->get()) << " to everyone:\n" << indent(msg) << "\n> ";
+        job.kind = Job::Kind::Private;
+        job.to = *maybe_to;
+    }
 
-    send_to_all_registered_except(reg, from.id(), out.str(), buf);
-    send_or_remove(from, reg, "> ", buf);
+    job.text = recv.substr(pos_blank + 1);
+    job.piece = piece;
+    if (piece == Job::Piece::First) {
+        using To = ClientRecord::Stream::To;
+        shard.registry.find(client)->stream = ClientRecord::Stream{
+            .to = job.kind == Job::Kind::Broadcast ? To::Everyone
+                  : job.kind == Job::Kind::Private ? To::User
+                                                   : To::Channel,
+            .user = job.to,
+            .channel = job.channel,
+        };
+    }
+    dispatch(shard, std::move(job), buf);
 }
 
-static void handle_private(
-    ServerClient& from, ServerClient& to, Registry& reg, std::string_view msg,
+// Passes a later piece of a message sent in chunks on to where the first one went.
+static void handle_stream_data(
+    Registry::Handle client, Shard& shard, std::string_view recv, Job::Piece piece,
     std::vector<std::byte>& buf) {
-    const auto user_name = reg.get_user_name(from.id());
+    const auto record = shard.registry.find(client);
+    const auto stream = record->stream.value_or(ClientRecord::Stream{});
+    if (piece == Job::Piece::Last) {
+        record->stream.reset();
+    }
 
-    std::ostringstream out("\n");
-    if (from.id() == to.id()) {
-        out << "Note to self:";
-    } else {
-        out << std::string_view(user_name->get()) << " to you:";
+    using To = ClientRecord::Stream::To;
+    if (stream.to == To::Nowhere) {
+        return;
     }
-    out << '\n' << indent(msg) << "\n> ";
+    dispatch(
+        shard,
+        Job{
+            .kind = stream.to == To::Everyone ? Job::Kind::Broadcast
+                    : stream.to == To::User   ? Job::Kind::Private
+                                              : Job::Kind::ToChannel,
+            .from = {.shard = shard.index, .client = client},
+            .user_name = *record->user_name,
+            .text = recv,
+            .to = stream.user,
+            .channel = stream.channel,
+            .piece = piece,
+        },
+        buf);
+}
 
-    send_or_remove(to, reg, out.str(), buf);
-    if (from.id() != to.id()) {
-        send_or_remove(from, reg, "> ", buf);
+// Leaves the client's data alone until its worker has room for more jobs.
+static void stall(Registry::Handle client, Shard& shard) {
+    if (std::find(shard.stalled.begin(), shard.stalled.end(), client) == shard.stalled.end()) {
+        shard.stalled.push_back(client);
     }
+    shard.wants_space.store(true, std::memory_order_relaxed);
 }
 
+// Receives everything the client has sent and handles each complete message in turn,
+// according to the state of the client, until the client is removed.
 static void
-handle_registered_client_data(ServerClient& client, Registry& reg, std::vector<std::byte>& buf) {
-    auto recv = recv_or_remove(client, reg, buf);
-    if (!recv.has_value()) {
+handle_client_data(Registry::Handle client, Shard& shard, std::vector<std::byte>& buf) {
+    auto& reg = shard.registry;
+    const auto record = reg.find(client);
+    if (record == nullptr) {
+        // Removed while handling a previous client of the same poll.
         return;
     }
-
-    const auto pos_blank = recv->find(' ');
-    if (pos_blank == std::string::npos) {
-        send_or_remove(client, reg, "Can't send empty message. Try again!\n> ", buf);
+    if (!shard.can_dispatch(client)) {
+        // Not even reading, so that the backpressure reaches the client.
+        stall(client, shard);
         return;
     }
 
-    std::string_view user_name_in(recv->data(), pos_blank);
-    std::string_view msg(recv->data() + pos_blank + 1, recv->size() - pos_blank - 1);
+    IoResult received;
+    {
+        const trace::Span span("recv");
+        received = record->client.try_recv(record->decoder.buffer());
+    }
+    const bool is_connected =
+        received.status == IoStatus::Ok || received.status == IoStatus::WouldBlock;
+    shard.metrics.bytes_in.add(received.bytes);
+    if (received.bytes != 0) {
+        // Timers are not moved on each receive: they find out when they expire.
+        record->heard_at = shard.polled_at;
+    }
 
-    if (user_name_in == "bc") {
-        handle_broadcast(client, reg, msg, buf);
-        return;
+    while (reg.contains(client)) {
+        if (!shard.can_dispatch(client)) {
+            // The rest, including a disconnection, is handled once the client is resumed.
+            stall(client, shard);
+            return;
+        }
+
+        proto::Decoder::Result recv;
+        {
+            const trace::Span span("decode");
+            recv = reg.find(client)->decoder.next();
+        }
+        if (recv.status == proto::Decoder::Status::Incomplete) {
+            break;
+        }
+        shard.metrics.messages_in.add();
+
+        const trace::Span span("handle");
+
+        if (recv.status == proto::Decoder::Status::Invalid) {
+            reply(client, shard, replies.invalid_message, buf);
+        } else if (recv.status == proto::Decoder::Status::Hello) {
+            // Goes through the same path as the messages queued before it, so that the client
+            // gets them in the encoding it was speaking until then.
+            const auto encoding = *reg.find(client)->decoder.hello();
+            reply(client, shard, encode_hello(encoding), buf, encoding);
+        } else if (recv.status == proto::Decoder::Status::Ping) {
+            reply(client, shard, replies.pong, buf);
+        } else if (recv.status == proto::Decoder::Status::Disconnect) {
+            remove_and_broadcast(client, shard, false, buf);
+        } else if (recv.is_continuation) {
+            const auto piece = recv.status == proto::Decoder::Status::Chunk ? Job::Piece::Middle
+                                                                            : Job::Piece::Last;
+            handle_stream_data(client, shard, recv.message, piece, buf);
+        } else if (reg.is_registered(client)) {
+            const auto piece = recv.status == proto::Decoder::Status::Chunk ? Job::Piece::First
+                                                                            : Job::Piece::Whole;
+            handle_registered_client_data(client, shard, recv.message, piece, buf);
+        } else if (recv.status == proto::Decoder::Status::Chunk) {
+            // Far too long for a user name, and so is the rest.
+            reg.find(client)->stream = ClientRecord::Stream{};
+            reply(client, shard, replies.invalid_user_name, buf);
+        } else {
+            handle_unregistered_client_data(client, shard, recv.message, buf);
+        }
     }
 
-    const auto maybe_user_name = Username::parse(user_name_in);
-    if (!maybe_user_name.has_value()) {
-        send_or_remove(client, reg, "Invalid user name. Try again!\n> ", buf);
+    if (!is_connected && reg.contains(client)) {
+        remove_and_broadcast(client, shard, true, buf);
+    }
+}
+
+// Removes the client if it stayed quiet for too long, and otherwise pings it if it is time to
+// and arms its timer again.
+static void handle_timer(Registry::Handle client, Shard& shard, std::vector<std::byte>& buf) {
+    const auto record = shard.registry.find(client);
+    record->timer = {};
+    const auto& timeouts = shard.cluster.timeouts;
+    const auto now = shard.timers.now();
+    const auto quiet = now - record->heard_at;
+
+    if (!record->user_name.has_value() || (timeouts.idle != 0 && quiet >= timeouts.idle)) {
+        shard.metrics.timeouts.add();
+        remove_and_broadcast(client, shard, true, buf);
         return;
     }
 
-    auto maybe_to = reg.get_client(*maybe_user_name);
-    if (!maybe_to.has_value()) {
-        send_or_remove(client, reg, "This user doesn't exist. Misspelled?\n> ", buf);
+    auto deadline = timeouts.idle != 0 ? record->heard_at + timeouts.idle : UINT64_MAX;
+    const bool can_ping = timeouts.ping != 0 && record->encoding.version != proto::Version::V1;
+    const bool should_ping = can_ping && quiet >= timeouts.ping;
+    if (can_ping) {
+        deadline = std::min(deadline, (should_ping ? now : record->heard_at) + timeouts.ping);
+    }
+    if (deadline == UINT64_MAX) {
         return;
     }
+    record->timer = shard.timers.arm(deadline, client);
 
-    handle_private(client, *maybe_to, reg, msg, buf);
+    if (should_ping) {
+        // Armed first, as a failed send removes the client.
+        shard.metrics.pings.add();
+        reply(client, shard, replies.pong, buf);
+    }
 }
 
-int main(int argc, char** argv) try {
-    if (argc < 2) {
-        std::cerr << "termchat: no port specified\n";
-        return 1;
+// Delivers what was rendered for this shard, moves backlogged jobs to the workers and resumes
+// the stalled clients they have room for.
+static void handle_workers(Shard& shard, std::vector<std::byte>& buf) {
+    const trace::Span span("workers");
+    shard.mailbox.take([&](Envelope&& envelope) { deliver(shard, std::move(envelope), buf); });
+
+    for (auto& ring : shard.rendered) {
+        while (auto envelope = ring->try_pop()) {
+            deliver(shard, std::move(*envelope), buf);
+        }
     }
 
-    const unsigned short port = std::stoul(argv[1]);
+    for (std::size_t worker = 0; worker < shard.backlog.size(); ++worker) {
+        auto& backlog = shard.backlog[worker];
+        auto& jobs = shard.jobs_of(worker);
+
+        bool pushed = false;
+        while (!backlog.empty() && jobs.try_push(std::move(backlog.front()))) {
+            backlog.pop_front();
+            pushed = true;
+        }
+        if (pushed && shard.cluster.workers[worker]->idle.should_wake()) {
+            shard.cluster.workers[worker]->idle.notify();
+        }
+    }
+
+    if (!shard.stalled.empty()) {
+        // Clients stalled again are added back as they are handled.
+        std::pmr::vector<Registry::Handle> stalled(
+            shard.stalled.begin(), shard.stalled.end(), shard.scratch.get());
+        shard.stalled.clear();
+        for (auto& client : stalled) {
+            handle_client_data(client, shard, buf);
+        }
+    }
+
+    const bool has_backlog = std::any_of(
+        shard.backlog.begin(), shard.backlog.end(), [](auto& jobs) { return !jobs.empty(); });
+    shard.wants_space.store(has_backlog || !shard.stalled.empty(), std::memory_order_relaxed);
+}
+
+// Whether handle_workers() has something to do.
+static bool has_worker_results(Shard& shard) {
+    for (auto& ring : shard.rendered) {
+        if (!ring->empty()) {
+            return true;
+        }
+    }
+    for (std::size_t worker = 0; worker < shard.backlog.size(); ++worker) {
+        if (!shard.backlog[worker].empty() && !shard.jobs_of(worker).full()) {
+            return true;
+        }
+    }
+    return std::any_of(shard.stalled.begin(), shard.stalled.end(), [&](const auto& c) {
+        return shard.can_dispatch(c);
+    });
+}
+
+static void run(Shard& shard) {
+    using Clock = std::chrono::steady_clock;
+    const auto ns = [](Clock::duration d) {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(d).count();
+    };
 
-    Server server(port);
-    Registry registry;
     std::vector<ServerPollResult> polled;
     std::vector<std::byte> buf;
+    auto& metrics = shard.metrics;
+    trace::name_thread("shard " + std::to_string(shard.index));
 
     while (true) {
-        server.poll(registry.clients(), polled);
+        shard.idle.idle();
+        if (has_worker_results(shard)) {
+            // Not waiting for the network in this poll.
+            shard.server.wake();
+        }
+
+        auto timeout = std::chrono::milliseconds(-1);
+        if (const auto expiry = shard.timers.next_expiry(); expiry.has_value()) {
+            const auto now = shard.since_started(Clock::now());
+            timeout = std::chrono::milliseconds(*expiry > now ? *expiry - now : 0);
+        }
+
+        {
+            const trace::Span span("poll");
+            shard.server.poll(polled, timeout);
+        }
+        shard.idle.busy();
+        const auto polled_at = Clock::now();
+        shard.polled_at = shard.since_started(polled_at);
+        metrics.polls.add();
+        metrics.ready.observe(polled.size());
+
         for (auto& [client, status] : polled) {
             switch (status) {
             case ServerClientStatus::New:
-                handle_new_client(client, registry, buf);
+                handle_new_client(client, shard, buf);
+                // It may have sent something already.
+                [[fallthrough]];
             case ServerClientStatus::PendingData:
-                if (registry.is_registered(client.id())) {
-                    handle_registered_client_data(client, registry, buf);
-                } else {
-                    handle_unregistered_client_data(client, registry, buf);
+                handle_client_data(Registry::handle_of(client), shard, buf);
+            }
+        }
+
+        const auto handled_at = Clock::now();
+
+        {
+            const trace::Span span("timers");
+            shard.timers.advance(shard.polled_at, [&](Registry::Handle client) {
+                handle_timer(client, shard, buf);
+            });
+        }
+        handle_workers(shard, buf);
+        shard.scratch.release();
+
+        metrics.handler_ns.observe(ns(handled_at - polled_at));
+        metrics.iteration_ns.observe(ns(Clock::now() - polled_at));
+    }
+}
+
+static void run(Worker& worker, Cluster& cluster) {
+    std::vector<std::byte> buf;
+    trace::name_thread("worker " + std::to_string(worker.index));
+    std::vector<bool> has_rendered(cluster.shards.size());
+
+    while (true) {
+        bool did_work = false;
+
+        for (std::size_t from = 0; from < worker.jobs.size(); ++from) {
+            auto& jobs = *worker.jobs[from];
+
+            bool popped = false;
+            // A bounded batch, so that no shard starves the others.
+            for (std::size_t n = 0; n < ring_capacity; ++n) {
+                auto job = jobs.try_pop();
+                if (!job.has_value()) {
+                    break;
+                }
+                popped = true;
+
+                render(
+                    *job, cluster.directory, cluster.history.get(), cluster.shards.size(),
+                    cluster.should_compress(), buf, worker.scratch.get(),
+                    [&](std::size_t to_shard, Envelope envelope) {
+                        auto& shard = *cluster.shards[to_shard];
+                        auto& ring = *shard.rendered[worker.index];
+                        // Waits for the shard, which never waits for workers.
+                        while (!ring.try_push(std::move(envelope))) {
+                            shard.notify();
+                            std::this_thread::yield();
+                        }
+                        has_rendered[to_shard] = true;
+                    });
+                worker.scratch.release();
+            }
+
+            if (popped) {
+                did_work = true;
+                auto& shard = *cluster.shards[from];
+                std::atomic_thread_fence(std::memory_order_seq_cst);
+                if (shard.wants_space.load(std::memory_order_relaxed)) {
+                    has_rendered[from] = true;
+                }
+            }
+        }
+
+        for (std::size_t i = 0; i < has_rendered.size(); ++i) {
+            if (has_rendered[i]) {
+                cluster.shards[i]->notify();
+                has_rendered[i] = false;
+            }
+        }
+
+        if (did_work) {
+            continue;
+        }
+
+        worker.idle.idle();
+        const bool has_jobs = std::any_of(
+            worker.jobs.begin(), worker.jobs.end(), [](auto& jobs) { return !jobs->empty(); });
+        if (!has_jobs) {
+            worker.idle.wait();
+        }
+        worker.idle.busy();
+    }
+}
+
+// The metrics of all the shards added together, in the text format of Prometheus.
+static std::string render_metrics(const Cluster& cluster) {
+    const auto sum = [&](const Counter Metrics::*counter) {
+        std::uint64_t total = 0;
+        for (const auto& shard : cluster.shards) {
+            total += (shard->metrics.*counter).get();
+        }
+        return total;
+    };
+    const auto sum_histogram = [&]<class H>(const H Metrics::*histogram) {
+        typename H::Snapshot total;
+        for (const auto& shard : cluster.shards) {
+            total += (shard->metrics.*histogram).snapshot();
+        }
+        return total;
+    };
+
+    // Read before the counts they are taken from, so that the gauges never go negative.
+    const auto closed = sum(&Metrics::closed);
+    const auto deregistered = sum(&Metrics::deregistered);
+
+    std::string out;
+    MetricsWriter writer(out);
+    const auto accepted = sum(&Metrics::accepted);
+    const auto registered = sum(&Metrics::registered);
+    writer.gauge(
+        "termchat_connected_clients", "Clients connected.", std::int64_t(accepted - closed));
+    writer.gauge(
+        "termchat_registered_clients", "Clients which picked a user name.",
+        std::int64_t(registered - deregistered));
+    writer.counter("termchat_accepted_total", "Connections accepted.", accepted);
+    writer.counter("termchat_closed_total", "Connections closed, for any reason.", closed);
+    writer.counter(
+        "termchat_registrations_total", "Clients which picked a user name.", registered);
+    writer.counter(
+        "termchat_left_total", "Registered clients which said they were leaving.",
+        sum(&Metrics::left));
+    writer.counter(
+        "termchat_disconnected_total",
+        "Registered clients removed because their connection failed or closed.",
+        sum(&Metrics::disconnected));
+    writer.counter(
+        "termchat_messages_in_total", "Frames received from clients.",
+        sum(&Metrics::messages_in));
+    writer.counter(
+        "termchat_bytes_in_total", "Bytes received from clients.", sum(&Metrics::bytes_in));
+    writer.counter(
+        "termchat_messages_out_total", "Frames queued to clients.",
+        sum(&Metrics::messages_out));
+    writer.counter(
+        "termchat_bytes_out_total", "Bytes queued to clients.", sum(&Metrics::bytes_out));
+    writer.counter(
+        "termchat_send_failures_total", "Sends which failed, removing their client.",
+        sum(&Metrics::send_failures));
+    writer.counter(
+        "termchat_timeouts_total", "Clients removed for staying quiet for too long.",
+        sum(&Metrics::timeouts));
+    writer.counter(
+        "termchat_pings_total", "Pings sent to quiet clients.", sum(&Metrics::pings));
+    writer.counter("termchat_polls_total", "Returns from a poll.", sum(&Metrics::polls));
+    writer.histogram<Metrics::ReadyHistogram>(
+        "termchat_poll_ready_events", "Events returned by a poll.",
+        sum_histogram(&Metrics::ready));
+    writer.histogram<Metrics::TimeHistogram>(
+        "termchat_loop_iteration_seconds", "Time from the return of a poll to the next one.",
+        sum_histogram(&Metrics::iteration_ns), 1e9);
+    writer.histogram<Metrics::TimeHistogram>(
+        "termchat_handler_seconds", "Time spent on the events returned by a poll.",
+        sum_histogram(&Metrics::handler_ns), 1e9);
+    return out;
+}
+
+// Reads a line, without its end, of up to max_size bytes. Returns false at the end of the
+// stream if nothing was read, and throws once past the deadline.
+static bool read_line(
+    Client& client, std::string& line, std::size_t max_size,
+    std::chrono::steady_clock::time_point deadline) {
+    std::vector<std::byte> c(1);
+    line.clear();
+    while (line.size() < max_size) {
+        if (std::chrono::steady_clock::now() > deadline) {
+            throw std::runtime_error("timed out");
+        }
+        if (!client.recv(c)) {
+            return !line.empty();
+        }
+        if (c[0] == std::byte('\n')) {
+            break;
+        }
+        line += char(c[0]);
+    }
+    if (!line.empty() && line.back() == '\r') {
+        line.pop_back();
+    }
+    return true;
+}
+
+// Answers each connection to the admin socket, one at a time. A request is a line:
+// - "metrics", an empty line or none at all, for the metrics;
+// - "trace start" or "trace stop", to turn tracing on or off;
+// - "trace", for what was traced;
+// or an HTTP GET, of /trace for what was traced and of anything else for the metrics, so that
+// the socket can also be scraped with curl --unix-socket.
+static void serve_admin(LocalServer& admin, const Cluster& cluster) {
+    constexpr std::size_t max_line_size = 1024;
+    // Connections are served one at a time, so one which stalls is dropped past this rather
+    // than holding up the others.
+    constexpr std::chrono::seconds timeout(2);
+    // Accepting fails when out of descriptors or memory; the connections wait in the backlog
+    // until it is retried, after this.
+    constexpr std::chrono::seconds accept_backoff(1);
+
+    while (true) {
+        bool is_accepted = false;
+        try {
+            auto client = admin.accept();
+            is_accepted = true;
+            client.set_timeout(timeout);
+            const auto deadline = std::chrono::steady_clock::now() + timeout;
+            std::string line;
+            const bool has_line = read_line(client, line, max_line_size, deadline);
+
+            std::string response;
+            if (line.starts_with("GET ")) {
+                // The headers are read so that closing doesn't reset the connection.
+                std::string header;
+                while (read_line(client, header, max_line_size, deadline) && !header.empty()) {
                 }
+                const bool is_trace = line.starts_with("GET /trace ");
+                const auto body = is_trace ? trace::to_chrome_json() : render_metrics(cluster);
+                response = std::string("HTTP/1.0 200 OK\r\nContent-Type: ") +
+                           (is_trace ? "application/json" : "text/plain; version=0.0.4") +
+                           "\r\nContent-Length: " + std::to_string(body.size()) + "\r\n\r\n" +
+                           body;
+            } else if (!has_line || line.empty() || line == "metrics") {
+                response = render_metrics(cluster);
+            } else if (line == "trace") {
+                response = trace::to_chrome_json();
+            } else if (line == "trace start" || line == "trace stop") {
+                trace::enable(line == "trace start");
+                response = "ok\n";
+            } else {
+                response = "unknown command\n";
+            }
+            client.send(std::as_bytes(std::span(response)));
+        } catch (const std::exception& e) {
+            if (!is_accepted) {
+                std::cerr << "termchat: admin: " << e.what() << '\n';
+                std::this_thread::sleep_for(accept_backoff);
+                continue;
             }
+            std::cerr << "termchat: admin connection: " << e.what() << '\n';
+        }
+    }
+}
+
+// Turns tracing on or off on SIGUSR1, and writes what was traced to path on SIGUSR2. The
+// signals must be blocked on all threads.
+static void handle_trace_signals(const sigset_t& signals, const std::string& path) {
+    while (true) {
+        int signal = 0;
+        if (sigwait(&signals, &signal) != 0) {
+            continue;
+        }
+
+        if (signal == SIGUSR1) {
+            trace::enable(!trace::is_enabled());
+            std::cerr << "termchat: tracing " << (trace::is_enabled() ? "on" : "off") << '\n';
+        } else if (std::ofstream out(path); !(out << trace::to_chrome_json()).flush()) {
+            std::cerr << "termchat: failed to write the trace to " << path << '\n';
+        } else {
+            std::cerr << "termchat: trace written to " << path << '\n';
+        }
+    }
+}
+
+int main(int argc, char** argv) try {
+    if (argc < 2) {
+        std::cerr << "termchat: no port specified\n";
+        return 1;
+    }
+
+    const unsigned short port = std::stoul(argv[1]);
+
+    ServerOptions options;
+    std::size_t thread_count = 1;
+    std::size_t worker_count = 0;
+    std::string admin_path;
+    std::string trace_path = "termchat-trace.json";
+    Timeouts timeouts;
+    std::string history_path;
+    History::Options history_options;
+    for (int i = 2; i < argc; ++i) {
+        const std::string_view arg = argv[i];
+        const std::string_view value = i + 1 < argc ? argv[i + 1] : "";
+
+        if (arg == "--io-uring") {
+            options.engine = ServerEngine::Uring;
+        } else if (arg == "--send-queue-limit" && !value.empty()) {
+            options.send_queue_limit = std::stoul(argv[++i]);
+        } else if (arg == "--backlog" && !value.empty()) {
+            options.backlog = std::stoi(argv[++i]);
+        } else if (arg == "--threads" && !value.empty()) {
+            thread_count = std::stoul(argv[++i]);
+        } else if (arg == "--workers" && !value.empty()) {
+            worker_count = std::stoul(argv[++i]);
+        } else if (arg == "--register-timeout" && !value.empty()) {
+            timeouts.registration = std::stoull(argv[++i]) * 1000;
+        } else if (arg == "--idle-timeout" && !value.empty()) {
+            timeouts.idle = std::stoull(argv[++i]) * 1000;
+        } else if (arg == "--ping-interval" && !value.empty()) {
+            timeouts.ping = std::stoull(argv[++i]) * 1000;
+        } else if (arg == "--history" && !value.empty()) {
+            history_path = argv[++i];
+        } else if (arg == "--history-size" && !value.empty()) {
+            history_options.max_size = std::stoull(argv[++i]);
+        } else if (arg == "--history-age" && !value.empty()) {
+            history_options.max_age = std::chrono::seconds(std::stoull(argv[++i]));
+        } else if (arg == "--history-replay" && !value.empty()) {
+            history_options.replay_count = std::stoull(argv[++i]);
+        } else if (arg == "--admin" && !value.empty()) {
+            admin_path = argv[++i];
+        } else if (arg == "--trace") {
+            trace::enable(true);
+        } else if (arg == "--trace-file" && !value.empty()) {
+            trace_path = argv[++i];
+        } else if (arg == "--slow-client" && value == "drop-oldest") {
+            options.slow_client_policy = SlowClientPolicy::DropOldest;
+            ++i;
+        } else if (arg == "--slow-client" && value == "disconnect") {
+            options.slow_client_policy = SlowClientPolicy::Disconnect;
+            ++i;
+        } else if (arg == "--slow-client" && value == "pause") {
+            options.slow_client_policy = SlowClientPolicy::PauseReading;
+            ++i;
+        } else {
+            std::cerr << "termchat: unknown option " << arg << '\n';
+            return 1;
+        }
+    }
+
+    if (thread_count == 0) {
+        std::cerr << "termchat: at least one thread is needed\n";
+        return 1;
+    }
+    // Each thread listens on its own socket, bound to the same port.
+    options.reuse_port = thread_count > 1;
+
+    Cluster cluster;
+    cluster.timeouts = timeouts;
+    if (!history_path.empty()) {
+        cluster.history = std::make_unique<History>(history_path, history_options);
+    }
+    for (std::size_t i = 0; i < thread_count; ++i) {
+        cluster.shards.push_back(std::make_unique<Shard>(i, cluster, port, options));
+    }
+    for (std::size_t i = 0; i < worker_count; ++i) {
+        auto worker = std::make_unique<Worker>();
+        worker->index = i;
+        for (auto& shard : cluster.shards) {
+            worker->jobs.push_back(std::make_unique<SpscRing<Job>>(ring_capacity));
+            shard->rendered.push_back(std::make_unique<SpscRing<Envelope>>(ring_capacity));
+            shard->backlog.emplace_back();
         }
+        cluster.workers.push_back(std::move(worker));
+    }
+    if (cluster.shards.front()->server.engine() != options.engine) {
+        std::cerr << "termchat: io_uring is not supported, falling back to poll\n";
+    }
+    std::optional<LocalServer> admin;
+    if (!admin_path.empty()) {
+        admin.emplace(admin_path);
     }
+
+    // The other threads never stop, so a failure on any of them ends the whole process.
+    const auto or_exit = [](auto&& f) {
+        try {
+            f();
+        } catch (const std::exception& e) {
+            std::cerr << e.what() << '\n';
+            std::exit(1);
+        }
+    };
+
+    // Inherited by the threads started from here on.
+    sigset_t trace_signals;
+    sigemptyset(&trace_signals);
+    sigaddset(&trace_signals, SIGUSR1);
+    sigaddset(&trace_signals, SIGUSR2);
+    pthread_sigmask(SIG_BLOCK, &trace_signals, nullptr);
+
+    std::vector<std::jthread> threads;
+    threads.emplace_back([&] { handle_trace_signals(trace_signals, trace_path); });
+    if (cluster.history != nullptr) {
+        threads.emplace_back([&] { or_exit([&] { cluster.history->run(); }); });
+    }
+    for (auto& worker : cluster.workers) {
+        threads.emplace_back([&, &worker = *worker] { or_exit([&] { run(worker, cluster); }); });
+    }
+    for (std::size_t i = 1; i < thread_count; ++i) {
+        threads.emplace_back([&, &shard = *cluster.shards[i]] { or_exit([&] { run(shard); }); });
+    }
+    if (admin.has_value()) {
+        threads.emplace_back([&] { or_exit([&] { serve_admin(*admin, cluster); }); });
+    }
+
+    or_exit([&] { run(*cluster.shards.front()); });
 } catch (const std::exception& e) {
     std::cerr << e.what() << '\n';
 }
\ No newline at end of file
@@ -0,0 +1,110 @@
+#ifndef TERMCHAT_SLOTMAP_H
+#define TERMCHAT_SLOTMAP_H
+
+#include <cstdint>
+#include <span>
+#include <utility>
+#include <vector>
+
+// Refers to a value of a SlotMap.
+struct SlotHandle {
+    std::uint32_t index = 0;
+    // Generations start at one, so a default constructed handle is never valid.
+    std::uint32_t generation = 0;
+
+    bool operator==(const SlotHandle&) const = default;
+
+    std::uint64_t bits() const noexcept { return (std::uint64_t(generation) << 32) | index; }
+    static SlotHandle from_bits(std::uint64_t bits) noexcept {
+        return {.index = std::uint32_t(bits), .generation = std::uint32_t(bits >> 32)};
+    }
+};
+
+// A container which hands out a handle for each value inserted. Looking a value up by its
+// handle, inserting and erasing are constant time, and the values are stored contiguously
+// for iteration. Erasing moves the last value into the hole, so the order is not kept.
+// A handle becomes stale once its value is erased: its slot's generation is bumped, so
+// that the handle doesn't refer to whatever reuses the slot later.
+template <class T> class SlotMap {
+public:
+    using Handle = SlotHandle;
+
+private:
+    static constexpr std::uint32_t none = UINT32_MAX;
+
+    struct Slot {
+        std::uint32_t generation = 1;
+        // The position of the value while the slot is used, the next free slot otherwise.
+        std::uint32_t pos_or_next_free = none;
+    };
+
+    std::vector<Slot> m_slots;
+    std::vector<T> m_values;
+    // The handle of each value, at the same position.
+    std::vector<Handle> m_handles;
+    // Head of the list of free slots, threaded through them.
+    std::uint32_t m_free = none;
+
+public:
+    Handle insert(T value) {
+        std::uint32_t index;
+        if (m_free != none) {
+            index = m_free;
+            m_free = m_slots[index].pos_or_next_free;
+        } else {
+            index = m_slots.size();
+            m_slots.emplace_back();
+        }
+
+        auto& slot = m_slots[index];
+        slot.pos_or_next_free = m_values.size();
+        const Handle handle{.index = index, .generation = slot.generation};
+
+        m_values.push_back(std::move(value));
+        m_handles.push_back(handle);
+        return handle;
+    }
+
+    // Returns null if the handle is stale.
+    T* find(Handle handle) noexcept {
+        if (handle.index >= m_slots.size() ||
+            m_slots[handle.index].generation != handle.generation) {
+            return nullptr;
+        }
+        return &m_values[m_slots[handle.index].pos_or_next_free];
+    }
+
+    bool contains(Handle handle) noexcept { return find(handle) != nullptr; }
+
+    // Returns false if the handle is stale.
+    bool erase(Handle handle) {
+        if (!contains(handle)) {
+            return false;
+        }
+
+        auto& slot = m_slots[handle.index];
+        const auto pos = slot.pos_or_next_free;
+        if (pos + 1 != m_values.size()) {
+            m_values[pos] = std::move(m_values.back());
+            m_handles[pos] = m_handles.back();
+            m_slots[m_handles[pos].index].pos_or_next_free = pos;
+        }
+        m_values.pop_back();
+        m_handles.pop_back();
+
+        if (++slot.generation == 0) {
+            slot.generation = 1;
+        }
+        slot.pos_or_next_free = m_free;
+        m_free = handle.index;
+        return true;
+    }
+
+    std::size_t size() const noexcept { return m_values.size(); }
+
+    // Both in the same order, which erasing changes.
+    std::span<T> values() noexcept { return m_values; }
+    std::span<const Handle> handles() const noexcept { return m_handles; }
+};
+
+#endif // TERMCHAT_SLOTMAP_H
@@ -1,13 +1,15 @@
 #include <algorithm>
+#include <array>
 #include <cstddef>
+#include <cstdint>
 #include <cstring>
+#include <deque>
 #include <exception>
 #include <functional>
 #include <iostream>
 #include <iterator>
 #include <memory>
 #include <span>
-#include <sstream>
 #include <stdexcept>
 #include <string>
 #include <sys/errno.h>
@@ -18,19 +20,31 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <netdb.h>
-#include <poll.h>
 #include <stdlib.h>
-#include <sys/poll.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
 #include <sys/types.h>
+#include <sys/un.h>
 #include <unistd.h>
 
+#ifdef __linux__
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#else
+#include <sys/event.h>
+#endif
+
+#include "engine.h"
 #include "socket.h"
+#include "trace.h"
+
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0 // SO_NOSIGPIPE is set on the socket instead
+#endif
 
 SocketError::SocketError(const char* fn, const char* info) : msg(), code(errno), function(fn) {
-    std::ostringstream out;
-    out << fn << ": " << info;
-    msg = std::move(out.str());
+    msg.append(fn).append(": ").append(info);
 }
 
 bool SocketError::would_block() const noexcept { return code == EAGAIN || code == EWOULDBLOCK; }
@@ -68,7 +82,7 @@ AddrInfo get_address_info(const char* ip, unsigned short port) {
 
 static int yes = 1;
 
-static int create_server_fd(unsigned short port) {
+static int create_server_fd(unsigned short port, const ServerOptions& options) {
     const auto addr = get_address_info(nullptr, port);
 
     auto fd = -1;
@@ -82,9 +96,14 @@ static int create_server_fd(unsigned short port) {
         if (setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof yes) == -1) {
             throw SocketError("setsockopt", strerror(errno));
         }
+        if (options.reuse_port &&
+            setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &yes, sizeof yes) == -1) {
+            throw SocketError("setsockopt", strerror(errno));
+        }
 
         if (bind(fd, p->ai_addr, p->ai_addrlen) == -1) {
             close(fd);
+            fd = -1;
             continue;
         }
 
@@ -95,8 +114,13 @@ static int create_server_fd(unsigned short port) {
         throw std::runtime_error("server failed to bind to an address");
     }
 
-    constexpr int backlog_size = 10; // could be customizable through constructor param
-    if (listen(fd, backlog_size) == -1) {
+    // Non-blocking, so that pending connections can be accepted until there are none left.
+    if (fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK) == -1 ||
+        fcntl(fd, F_SETFD, FD_CLOEXEC) == -1) {
+        throw SocketError("fcntl", strerror(errno));
+    }
+
+    if (listen(fd, options.backlog) == -1) {
         throw SocketError("listen", strerror(errno));
     }
 
@@ -112,7 +136,7 @@ static const void* get_in_addr(const sockaddr* sa) {
 
 static void send_data(int fd, std::span<const std::byte> data) {
     for (int total = 0, left = data.size(); total < data.size();) {
-        const auto n = send(fd, data.subspan(total).data(), left, 0);
+        const auto n = send(fd, data.subspan(total).data(), left, MSG_NOSIGNAL);
         if (n == -1) {
             throw SocketError("send", strerror(errno));
         }
@@ -122,6 +146,53 @@ static void send_data(int fd, std::span<const std::byte> data) {
     }
 }
 
+// Appends to the buffer everything that can be received without blocking.
+static IoResult try_recv_data(int fd, std::vector<std::byte>& buf) {
+    constexpr std::size_t chunk_size = 4096;
+
+    for (std::size_t total = 0;;) {
+        const auto size = buf.size();
+        buf.resize(size + chunk_size);
+        const auto n = ::recv(fd, buf.data() + size, chunk_size, MSG_DONTWAIT);
+        buf.resize(size + (n > 0 ? n : 0));
+
+        if (n > 0) {
+            total += n;
+        } else if (n == 0) {
+            return {.status = IoStatus::Closed, .bytes = total};
+        } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            return {.status = total > 0 ? IoStatus::Ok : IoStatus::WouldBlock, .bytes = total};
+        } else if (errno != EINTR) {
+            return io_failure(errno, total);
+        }
+    }
+}
+
+static IoResult try_send_data(int fd, std::span<const std::byte> data) {
+    std::size_t total = 0;
+    while (total < data.size()) {
+        const auto n = ::send(
+            fd, data.data() + total, data.size() - total, MSG_DONTWAIT | MSG_NOSIGNAL);
+        if (n >= 0) {
+            total += n;
+        } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            return {.status = total > 0 ? IoStatus::Ok : IoStatus::WouldBlock, .bytes = total};
+        } else if (errno != EINTR) {
+            return io_failure(errno, total);
+        }
+    }
+    return {.status = IoStatus::Ok, .bytes = total};
+}
+
+// Throws the error behind a failed result of a call to the given function.
+[[noreturn]] static void throw_io_error(const char* fn, const IoResult& res) {
+    errno = res.error;
+    if (res.error == ENOBUFS) {
+        throw SocketError(fn, "client is too slow to keep up");
+    }
+    throw SocketError(fn, strerror(errno));
+}
+
 static bool recv_data(int fd, std::vector<std::byte>& res) {
     for (int total = 0, left = res.size(); total < res.size();) {
         const auto n = recv(fd, res.data() + total, left, 0);
@@ -137,17 +208,537 @@ static bool recv_data(int fd, std::vector<std::byte>& res) {
     return true;
 }
 
+// Accepts a pending connection as a non-blocking socket. Returns -1 if there is none left.
+static int accept_client_fd(int server_fd, sockaddr_storage* addr) {
+    for (;;) {
+        socklen_t sz = sizeof *addr;
+#if defined(__linux__) || defined(__FreeBSD__)
+        const auto fd = accept4(server_fd, (sockaddr*)addr, &sz, SOCK_NONBLOCK | SOCK_CLOEXEC);
+#else
+        const auto fd = accept(server_fd, (sockaddr*)addr, &sz);
+        if (fd != -1) {
+            (void)fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK);
+            (void)fcntl(fd, F_SETFD, FD_CLOEXEC);
+        }
+#endif
+        if (fd != -1) {
+            disable_nagle(fd);
+#ifdef SO_NOSIGPIPE
+            (void)setsockopt(fd, SOL_SOCKET, SO_NOSIGPIPE, &yes, sizeof yes);
+#endif
+            return fd;
+        }
+
+        switch (errno) {
+        case EAGAIN:
+#if EWOULDBLOCK != EAGAIN
+        case EWOULDBLOCK:
+#endif
+            return -1;
+        // The connection was reset before it could be accepted: on to the next one.
+        case ECONNABORTED:
+        case EINTR:
+        case EPROTO:
+            continue;
+        // Out of descriptors or memory. The remaining connections wait in the backlog.
+        case EMFILE:
+        case ENFILE:
+        case ENOBUFS:
+        case ENOMEM:
+            return -1;
+        default:
+            throw SocketError("accept", strerror(errno));
+        }
+    }
+}
+
+//
+// OutboundQueue
+//
+
+bool OutboundQueue::push(Frame data, const ServerOptions& options) {
+    if (m_bytes + data.size() > options.send_queue_limit) {
+        switch (options.slow_client_policy) {
+        case SlowClientPolicy::DropOldest: {
+            // The kernel may still be reading from the messages of a send in flight.
+            const auto first = std::max<std::size_t>(1, m_pinned);
+            while (m_messages.size() > first &&
+                   m_bytes + data.size() > options.send_queue_limit) {
+                m_bytes -= m_messages[first].size();
+                m_messages.erase(m_messages.begin() + first);
+            }
+            break;
+        }
+        case SlowClientPolicy::Disconnect:
+            return false;
+        case SlowClientPolicy::PauseReading:
+            break;
+        }
+    }
+
+    m_bytes += data.size();
+    m_messages.push_back(std::move(data));
+    return true;
+}
+
+std::size_t OutboundQueue::gather(std::span<iovec> out) noexcept {
+    const auto n = std::min(out.size(), m_messages.size());
+    m_pinned = n;
+    for (std::size_t i = 0; i < n; ++i) {
+        const auto bytes = m_messages[i].bytes().subspan(i == 0 ? m_written : 0);
+        out[i] = iovec{.iov_base = (void*)bytes.data(), .iov_len = bytes.size()};
+    }
+    return n;
+}
+
+void OutboundQueue::consume(std::size_t n) noexcept {
+    m_pinned = 0;
+    m_bytes -= n;
+    while (n > 0) {
+        const auto left = m_messages.front().size() - m_written;
+        if (n < left) {
+            m_written += n;
+            return;
+        }
+        n -= left;
+        m_messages.pop_front();
+        m_written = 0;
+    }
+}
+
+bool Engine::update_paused(ClientState& c, const ServerOptions& options) noexcept {
+    if (options.slow_client_policy != SlowClientPolicy::PauseReading) {
+        return false;
+    }
+
+    const auto bytes = c.out.stats().bytes;
+    if (!c.is_paused && bytes > options.send_queue_limit) {
+        c.is_paused = true;
+    } else if (c.is_paused && bytes <= options.send_queue_limit / 2) {
+        c.is_paused = false;
+        return true;
+    }
+    return false;
+}
+
 //
-// ServerClient
+// Notifier
+//
+
+Notifier::Notifier() {
+#ifdef __linux__
+    m_read_fd = m_write_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (m_read_fd == -1) {
+        throw SocketError("eventfd", strerror(errno));
+    }
+#else
+    int fds[2];
+    if (pipe(fds) == -1) {
+        throw SocketError("pipe", strerror(errno));
+    }
+    for (const auto fd : fds) {
+        (void)fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK);
+        (void)fcntl(fd, F_SETFD, FD_CLOEXEC);
+    }
+    m_read_fd = fds[0];
+    m_write_fd = fds[1];
+#endif
+}
+
+void Notifier::notify() noexcept {
+    // If this fails the descriptor is already readable, which is all that matters.
+#ifdef __linux__
+    (void)eventfd_write(m_write_fd, 1);
+#else
+    const char c = 0;
+    (void)write(m_write_fd, &c, sizeof c);
+#endif
+}
+
+void Notifier::drain() noexcept {
+    char buf[64];
+    while (read(m_read_fd, buf, sizeof buf) > 0) {
+    }
+}
+
+Notifier::~Notifier() {
+    ::close(m_read_fd);
+    if (m_write_fd != m_read_fd) {
+        ::close(m_write_fd);
+    }
+}
+
+//
+// Poller
 //
 
-struct ServerClient::Private {
-    int fd;
-    ServerClient::ID id;
-    sockaddr_storage addr;
+// A thin wrapper over the readiness notification facility of the platform: epoll on Linux,
+// kqueue elsewhere. Each file descriptor is registered once, along with a pointer which
+// is handed back when the descriptor becomes readable. The kernel drops the registration
+// by itself when the descriptor is closed, so there is no explicit removal.
+//
+// Edge-triggered registrations are reported only when new data arrives, so whoever handles
+// them must read until the descriptor would block. They can also ask to be notified when
+// the descriptor becomes writable, after a write would have blocked.
+class Poller {
+private:
+    int m_fd;
+
+public:
+#ifdef __linux__
+    using Event = epoll_event;
+#else
+    using Event = struct kevent;
+#endif
+
+    Poller() {
+#ifdef __linux__
+        m_fd = epoll_create1(EPOLL_CLOEXEC);
+        if (m_fd == -1) {
+            throw SocketError("epoll_create1", strerror(errno));
+        }
+#else
+        m_fd = kqueue();
+        if (m_fd == -1) {
+            throw SocketError("kqueue", strerror(errno));
+        }
+#endif
+    }
+
+    Poller(const Poller&) = delete;
+    Poller& operator=(const Poller&) = delete;
+
+    void add(int fd, void* data, bool edge_triggered) {
+#ifdef __linux__
+        const uint32_t events = EPOLLIN | (edge_triggered ? uint32_t(EPOLLET) : 0);
+        epoll_event ev{.events = events, .data = {.ptr = data}};
+        if (epoll_ctl(m_fd, EPOLL_CTL_ADD, fd, &ev) == -1) {
+            throw SocketError("epoll_ctl", strerror(errno));
+        }
+#else
+        struct kevent ev;
+        EV_SET(&ev, fd, EVFILT_READ, EV_ADD | (edge_triggered ? EV_CLEAR : 0), 0, 0, data);
+        if (kevent(m_fd, &ev, 1, nullptr, 0, nullptr) == -1) {
+            throw SocketError("kevent", strerror(errno));
+        }
+#endif
+    }
+
+    void watch_writable(int fd, void* data, bool enable) {
+#ifdef __linux__
+        const uint32_t events = EPOLLIN | EPOLLET | (enable ? uint32_t(EPOLLOUT) : 0);
+        epoll_event ev{.events = events, .data = {.ptr = data}};
+        if (epoll_ctl(m_fd, EPOLL_CTL_MOD, fd, &ev) == -1) {
+            throw SocketError("epoll_ctl", strerror(errno));
+        }
+#else
+        struct kevent ev;
+        EV_SET(&ev, fd, EVFILT_WRITE, enable ? (EV_ADD | EV_CLEAR) : EV_DELETE, 0, 0, data);
+        if (kevent(m_fd, &ev, 1, nullptr, 0, nullptr) == -1) {
+            throw SocketError("kevent", strerror(errno));
+        }
+#endif
+    }
+
+    // Waits until at least one registered descriptor is ready, for at most timeout_ms unless
+    // it is negative, and fills the given buffer with as many events as fit. Returns the
+    // number of events.
+    std::size_t wait(std::span<Event> events, int timeout_ms = -1) {
+#ifdef __linux__
+        const auto n = epoll_wait(m_fd, events.data(), events.size(), timeout_ms);
+        if (n == -1) {
+            throw SocketError("epoll_wait", strerror(errno));
+        }
+#else
+        const timespec timeout{
+            .tv_sec = timeout_ms / 1000, .tv_nsec = (timeout_ms % 1000) * 1'000'000L};
+        const auto n = kevent(
+            m_fd, nullptr, 0, events.data(), events.size(), timeout_ms < 0 ? nullptr : &timeout);
+        if (n == -1) {
+            throw SocketError("kevent", strerror(errno));
+        }
+#endif
+        return n;
+    }
+
+    static void* data(const Event& ev) noexcept {
+#ifdef __linux__
+        return ev.data.ptr;
+#else
+        return ev.udata;
+#endif
+    }
+
+    // Errors and hangups count as readable, as they are found out by reading.
+    static bool is_readable(const Event& ev) noexcept {
+#ifdef __linux__
+        return ev.events & (EPOLLIN | EPOLLERR | EPOLLHUP);
+#else
+        return ev.filter == EVFILT_READ;
+#endif
+    }
+
+    static bool is_writable(const Event& ev) noexcept {
+#ifdef __linux__
+        return ev.events & EPOLLOUT;
+#else
+        return ev.filter == EVFILT_WRITE;
+#endif
+    }
+
+    ~Poller() { ::close(m_fd); }
 };
 
-ServerClient::ServerClient(ServerClient::Private* p) : m(p) {}
+//
+// PollEngine
+//
+
+class PollEngine : public Engine {
+private:
+    int m_fd;
+    ServerOptions m_options;
+    ServerClient::ID m_next_id;
+    Poller m_poller;
+    std::vector<Poller::Event> m_events;
+    Notifier m_notifier;
+    // Clients sent something since the last call to poll(), which writes it. They are kept
+    // alive until then, so that what was sent right before dropping them still goes out.
+    std::vector<std::shared_ptr<ClientState>> m_unflushed;
+
+    // Upper bound of the readiness events handled by a single call to poll().
+    // Whatever doesn't fit is reported by the next call.
+    static constexpr std::size_t max_events = 256;
+    // Upper bound of the connections accepted by a single call to poll(), so that a burst
+    // of them doesn't hold up the clients already connected.
+    static constexpr std::size_t max_accepts = 64;
+
+public:
+    // Writes as much of the client's queue as possible without blocking and makes sure
+    // the client is watched for writability only while something is left in the queue.
+    // Returns false if the write failed, with errno set.
+    bool flush(ClientState& c) {
+        const trace::Span span("send");
+        std::array<iovec, max_gather> iov;
+
+        while (!c.out.empty()) {
+            msghdr msg{};
+            msg.msg_iov = iov.data();
+            msg.msg_iovlen = c.out.gather(iov);
+            const auto flags = MSG_DONTWAIT | MSG_NOSIGNAL |
+                               (c.out.stats().messages > msg.msg_iovlen ? more_flag : 0);
+            const auto n = ::sendmsg(c.fd, &msg, flags);
+            if (n == -1) {
+                if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                    break;
+                }
+                return false;
+            }
+            c.out.consume(n);
+        }
+
+        if (const bool wants_write = !c.out.empty(); wants_write != c.wants_write) {
+            m_poller.watch_writable(c.fd, &c, wants_write);
+            c.wants_write = wants_write;
+        }
+        return true;
+    }
+
+public:
+    PollEngine(int listen_fd, const ServerOptions& options)
+        : m_fd(listen_fd), m_options(options), m_next_id(0), m_events(max_events) {
+        // The listening socket and the notifier are the only registrations without an
+        // associated client. The notifier is told apart by its address.
+        m_poller.add(m_fd, nullptr, false);
+        m_poller.add(m_notifier.fd(), &m_notifier, false);
+    }
+
+    ServerEngine kind() const noexcept override { return ServerEngine::Poll; }
+
+    void poll(std::vector<ServerPollResult>& res, std::chrono::milliseconds timeout) override {
+        res.resize(0);
+
+        // Everything sent to a client since the last call goes out in as few writes as
+        // possible, often a single one. Failures are reported right away, without waiting.
+        {
+            const trace::Span span("flush");
+            for (auto& p : m_unflushed) {
+                p->is_unflushed = false;
+                if (p->fd == -1 || p->wants_write || p->error != 0) {
+                    continue;
+                }
+                if (!flush(*p)) {
+                    p->error = errno;
+                    res.push_back(ServerPollResult{
+                        .client = make_client(std::move(p)),
+                        .status = ServerClientStatus::PendingData});
+                }
+            }
+            m_unflushed.clear();
+        }
+
+        std::size_t num_ready = 0;
+        {
+            const trace::Span span("wait");
+            num_ready = m_poller.wait(m_events, res.empty() ? timeout.count() : 0);
+        }
+
+        for (const auto& ev : std::span(m_events).first(num_ready)) {
+            const auto data = Poller::data(ev);
+            if (data == nullptr) {
+                // The listening socket is level-triggered: what is left over is reported
+                // again by the next call.
+                const trace::Span span("accept");
+                for (std::size_t i = 0; i < max_accepts; ++i) {
+                    sockaddr_storage addr;
+                    const auto fd = accept_client_fd(m_fd, &addr);
+                    if (fd == -1) {
+                        break;
+                    }
+                    auto p = std::make_shared<ClientState>(
+                        fd, ++m_next_id, addr, shared_from_this());
+                    m_poller.add(fd, p.get(), true);
+                    res.push_back(ServerPollResult{
+                        .client = make_client(std::move(p)), .status = ServerClientStatus::New});
+                }
+                continue;
+            } else if (data == &m_notifier) {
+                m_notifier.drain();
+                continue;
+            }
+
+            // The client is alive: its descriptor is closed only once the last
+            // ServerClient referring to it is gone, which also unregisters it.
+            const auto p = static_cast<ClientState*>(data);
+
+            // Failed writes and resumed reads are found out by the server through
+            // recv_available(), so they are reported just like incoming data.
+            auto should_report = Poller::is_readable(ev);
+            if (Poller::is_writable(ev) && p->wants_write) {
+                if (!flush(*p)) {
+                    p->error = errno;
+                    should_report = true;
+                } else if (update_paused(*p, m_options)) {
+                    should_report = true;
+                }
+            }
+
+            if (should_report) {
+                res.push_back(ServerPollResult{
+                    .client = make_client(p->shared_from_this()),
+                    .status = ServerClientStatus::PendingData});
+            }
+        }
+    }
+
+    void wake() noexcept override { m_notifier.notify(); }
+
+    void shutdown() override {
+        if (::shutdown(m_fd, 2 /* further sends and recvs are disallowed */) == -1) {
+            throw SocketError("shutdown", strerror(errno));
+        }
+    }
+
+    IoResult try_send(ClientState& c, Frame data) override {
+        if (c.error != 0) {
+            return io_failure(c.error);
+        }
+        const auto size = data.size();
+        if (!c.out.push(std::move(data), m_options)) {
+            return {.status = IoStatus::Error, .error = ENOBUFS};
+        }
+        // Resuming is left to poll(), once the client becomes writable.
+        (void)update_paused(c, m_options);
+
+        // Written by the next poll(), along with whatever else is sent to the client until
+        // then, or once the client is writable if it's not.
+        if (!c.is_unflushed && !c.wants_write) {
+            c.is_unflushed = true;
+            m_unflushed.push_back(c.shared_from_this());
+        }
+        return {.status = IoStatus::Ok, .bytes = size};
+    }
+
+    bool recv(ClientState& c, std::vector<std::byte>& res) override {
+        return recv_data(c.fd, res);
+    }
+
+    IoResult try_recv(ClientState& c, std::vector<std::byte>& buf) override {
+        if (c.error != 0) {
+            return io_failure(c.error);
+        }
+        // What is left unread is received once the client is reported again, on resume.
+        if (c.is_paused) {
+            return {.status = IoStatus::WouldBlock};
+        }
+        return try_recv_data(c.fd, buf);
+    }
+
+    void set_blocking(ClientState& c, bool should_block) override {
+        if (should_block == c.is_blocking) {
+            return;
+        }
+
+        auto flags = fcntl(c.fd, F_GETFL, 0);
+        if (flags == -1) {
+            throw SocketError("fcntl", strerror(errno));
+        }
+
+        flags = should_block ? (flags & ~O_NONBLOCK) : (flags | O_NONBLOCK);
+        if (fcntl(c.fd, F_SETFL, flags) == -1) {
+            throw SocketError("fcntl", strerror(errno));
+        }
+        c.is_blocking = should_block;
+    }
+
+    void close(ClientState& c) override {
+        if (::close(c.fd) == -1) {
+            throw SocketError("close", strerror(errno));
+        }
+    }
+
+    ~PollEngine() override { ::close(m_fd); }
+};
+
+std::shared_ptr<Engine> make_poll_engine(int listen_fd, const ServerOptions& options) {
+    return std::make_shared<PollEngine>(listen_fd, options);
+}
+
+#ifndef __linux__
+std::shared_ptr<Engine> make_uring_engine(int, const ServerOptions&) { return nullptr; }
+#endif
+
+//
+// Frame
+//
+
+Frame::Frame(std::span<const std::byte> bytes)
+    : Frame(std::initializer_list<std::span<const std::byte>>{bytes}) {}
+
+Frame::Frame(std::initializer_list<std::span<const std::byte>> parts) {
+    for (const auto part : parts) {
+        m_size += part.size();
+    }
+
+    auto p = std::make_shared_for_overwrite<std::byte[]>(m_size);
+    auto out = p.get();
+    for (const auto part : parts) {
+        out = std::copy(part.begin(), part.end(), out);
+    }
+    m = std::move(p);
+}
+
+Frame Frame::slice(std::size_t offset, std::size_t size) const noexcept {
+    Frame f;
+    f.m = std::shared_ptr<const std::byte[]>(m, m.get() + offset);
+    f.m_size = size;
+    return f;
+}
+
+//
+// ServerClient
+//
+
+ServerClient::ServerClient(std::shared_ptr<ServerClient::Private> p) : m(std::move(p)) {}
 
 ServerClient::ID ServerClient::id() const noexcept { return m->id; }
 
@@ -156,33 +747,64 @@ std::string ServerClient::address() const noexcept {
     return inet_ntop(m->addr.ss_family, get_in_addr((sockaddr*)&m->addr), buf, sizeof buf);
 }
 
-void ServerClient::send(std::span<const std::byte> data) { send_data(m->fd, data); }
+void ServerClient::set_tag(std::uint64_t tag) noexcept { m->tag = tag; }
 
-bool ServerClient::recv(std::vector<std::byte>& res) { return recv_data(m->fd, res); }
+std::uint64_t ServerClient::tag() const noexcept { return m->tag; }
 
-void ServerClient::set_blocking(bool should_block) {
-    auto flags = fcntl(m->fd, F_GETFL, 0);
-    if (flags == -1) {
-        throw SocketError("fcntl", strerror(errno));
+ServerClient::QueueStats ServerClient::queued() const noexcept { return m->out.stats(); }
+
+void ServerClient::send(std::span<const std::byte> data) {
+    send(Frame(data));
+}
+
+void ServerClient::send(Frame frame) {
+    if (const auto res = try_send(std::move(frame)); !res.ok()) {
+        throw_io_error("send", res);
     }
+}
 
-    flags = should_block ? (flags & ~O_NONBLOCK) : (flags | O_NONBLOCK);
-    if (fcntl(m->fd, F_SETFL, flags) == -1) {
-        throw SocketError("fcntl", strerror(errno));
+bool ServerClient::recv(std::vector<std::byte>& res) { return m->engine->recv(*m, res); }
+
+bool ServerClient::recv_available(std::vector<std::byte>& buf) {
+    const auto res = try_recv(buf);
+    switch (res.status) {
+    case IoStatus::Ok:
+    case IoStatus::WouldBlock:
+        return true;
+    case IoStatus::Closed:
+        if (res.error == 0) {
+            return false;
+        }
+        break;
+    case IoStatus::Error:
+        break;
     }
+    throw_io_error("recv", res);
 }
 
+IoResult ServerClient::try_send(std::span<const std::byte> data) {
+    return try_send(Frame(data));
+}
+
+IoResult ServerClient::try_send(Frame frame) { return m->engine->try_send(*m, std::move(frame)); }
+
+IoResult ServerClient::try_recv(std::vector<std::byte>& buf) {
+    return m->engine->try_recv(*m, buf);
+}
+
+void ServerClient::set_blocking(bool should_block) { m->engine->set_blocking(*m, should_block); }
+
 void ServerClient::close() {
-    if (::close(m->fd) == -1) {
-        throw SocketError("close", strerror(errno));
-    }
+    m->engine->close(*m);
     m->fd = -1;
 }
 
-ServerClient::~ServerClient() {
+ServerClient::~ServerClient() = default;
+
+ServerClient::Private::~Private() {
     try {
-        if (m.use_count() == 1 && m->fd != -1) {
-            close();
+        if (fd != -1) {
+            engine->close(*this);
         }
     } catch (const std::exception& e) {
         (void)e;
@@ -194,73 +816,42 @@ ServerClient::~ServerClient() {
 //
 
 struct Server::Private {
-    int fd;
-    std::size_t next_id;
-    std::vector<pollfd> pfd_buf;
+    std::shared_ptr<Engine> engine;
+    bool is_shut_down;
 };
 
-Server::Server(unsigned short port)
-    : m(new Server::Private{.fd = create_server_fd(port), .next_id = 0}) {}
-
-static int accept_client_fd(int server_fd, sockaddr_storage* addr) {
-    socklen_t sz = sizeof *addr;
-    auto fd = accept(server_fd, (sockaddr*)addr, &sz);
-    if (fd == -1) {
-        throw SocketError("accept", strerror(errno));
+static std::shared_ptr<Engine> make_engine(const ServerOptions& options, int listen_fd) {
+    if (options.engine == ServerEngine::Uring) {
+        if (auto e = make_uring_engine(listen_fd, options)) {
+            return e;
+        }
     }
-    return fd;
+    return make_poll_engine(listen_fd, options);
 }
 
-void Server::poll(std::span<const ServerClient> to_poll, std::vector<ServerPollResult>& res) {
-    res.resize(0);
-    m->pfd_buf.resize(0);
+Server::Server(unsigned short port, ServerOptions options)
+    : m(new Server::Private{
+          .engine = make_engine(options, create_server_fd(port, options))}) {}
 
-    m->pfd_buf.push_back(pollfd{.fd = m->fd, .events = POLLIN});
-    for (const auto& c : to_poll) {
-        m->pfd_buf.push_back(pollfd{.fd = c.m->fd, .events = POLLIN});
-    }
-
-    auto num_ready = ::poll(m->pfd_buf.data(), m->pfd_buf.size(), -1);
-    if (num_ready == -1) {
-        throw SocketError("poll", strerror(errno));
-    }
-
-    for (const auto& p : m->pfd_buf) {
-        if (!(p.revents & POLLIN)) {
-            continue;
-        }
+void Server::poll(std::vector<ServerPollResult>& res, std::chrono::milliseconds timeout) {
+    m->engine->poll(res, timeout);
+}
 
-        if (p.fd == m->fd) {
-            sockaddr_storage addr;
-            const auto fd = accept_client_fd(m->fd, &addr);
-            ServerClient c{new ServerClient::Private{.fd = fd, .id = ++m->next_id, .addr = addr}};
-            ServerPollResult res_one{.client = c, .status = ServerClientStatus::New};
-            res.push_back(res_one);
-        } else {
-            const auto it =
-                std::find_if(to_poll.begin(), to_poll.end(), [&p](const ServerClient& c) {
-                    return c.m->fd == p.fd;
-                });
-            ServerPollResult res_one{.client = *it, .status = ServerClientStatus::PendingData};
-            res.push_back(res_one);
-        }
+void Server::wake() noexcept { m->engine->wake(); }
 
-        if (--num_ready == 0) {
-            break;
-        }
-    }
-}
+ServerEngine Server::engine() const noexcept { return m->engine->kind(); }
 
 void Server::shutdown() {
-    if (::shutdown(m->fd, 2 /* further sends and recvs are disallowed */) == -1) {
-        throw SocketError("shutdown", strerror(errno));
+    if (m->is_shut_down) {
+        throw std::logic_error("server already shut down");
     }
-    m->fd = -1;
+    m->engine->shutdown();
+    m->is_shut_down = true;
 }
 
 Server::~Server() {
     try {
-        if (m->fd != -1) {
+        if (m && !m->is_shut_down) {
             shutdown();
         }
     } catch (const std::exception& e) {
@@ -301,6 +892,19 @@ void Client::send(std::span<const std::byte> data) { send_data(m_fd, data); }
 
 bool Client::recv(std::vector<std::byte>& res) { return recv_data(m_fd, res); }
 
+IoResult Client::try_send(std::span<const std::byte> data) { return try_send_data(m_fd, data); }
+
+IoResult Client::try_recv(std::vector<std::byte>& buf) { return try_recv_data(m_fd, buf); }
+
+void Client::set_timeout(std::chrono::milliseconds timeout) {
+    const auto us = std::chrono::duration_cast<std::chrono::microseconds>(timeout).count();
+    const timeval tv{.tv_sec = time_t(us / 1'000'000), .tv_usec = suseconds_t(us % 1'000'000)};
+    if (setsockopt(m_fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof tv) == -1 ||
+        setsockopt(m_fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof tv) == -1) {
+        throw SocketError("setsockopt", strerror(errno));
+    }
+}
+
 void Client::close() {
     if (::close(m_fd) == -1) {
         throw SocketError("close", strerror(errno));
@@ -316,4 +920,80 @@ Client::~Client() {
     } catch (const std::exception& e) {
         (void)e;
     }
-}
\ No newline at end of file
+}
+
+//
+// LocalServer
+//
+
+LocalServer::LocalServer(std::string path) : m_fd(-1), m_path(std::move(path)) {
+    sockaddr_un addr{};
+    addr.sun_family = AF_UNIX;
+    if (m_path.empty() || m_path.size() >= sizeof addr.sun_path) {
+        throw std::invalid_argument("invalid Unix socket path");
+    }
+    std::copy(m_path.begin(), m_path.end(), addr.sun_path);
+
+    struct stat st;
+    if (lstat(m_path.c_str(), &st) == 0 && S_ISSOCK(st.st_mode)) {
+        (void)unlink(m_path.c_str());
+    }
+
+    m_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (m_fd == -1) {
+        throw SocketError("socket", strerror(errno));
+    }
+    if (fcntl(m_fd, F_SETFD, FD_CLOEXEC) == -1 ||
+        bind(m_fd, reinterpret_cast<const sockaddr*>(&addr), sizeof addr) == -1 ||
+        listen(m_fd, 16) == -1) {
+        const auto error = SocketError("bind", strerror(errno));
+        ::close(m_fd);
+        throw error;
+    }
+}
+
+Client LocalServer::accept() {
+    for (;;) {
+        const auto fd = ::accept(m_fd, nullptr, nullptr);
+        if (fd != -1) {
+#ifdef SO_NOSIGPIPE
+            (void)setsockopt(fd, SOL_SOCKET, SO_NOSIGPIPE, &yes, sizeof yes);
+#endif
+            return Client(fd);
+        }
+        if (errno != EINTR && errno != ECONNABORTED) {
+            throw SocketError("accept", strerror(errno));
+        }
+    }
+}
+
+LocalServer::~LocalServer() {
+    ::close(m_fd);
+    (void)unlink(m_path.c_str());
+}
+
+//
+// ClientPoller
+//
+
+struct ClientPoller::Private {
+    Poller poller;
+    std::array<Poller::Event, 256> events;
+};
+
+ClientPoller::ClientPoller() : m(std::make_unique<Private>()) {}
+
+void ClientPoller::add(const Client& client, std::size_t tag) {
+    m->poller.add(client.m_fd, reinterpret_cast<void*>(tag), false);
+}
+
+void ClientPoller::wait(std::vector<std::size_t>& ready, std::chrono::milliseconds timeout) {
+    const auto n = m->poller.wait(m->events, timeout.count());
+
+    ready.clear();
+    for (const auto& ev : std::span(m->events).first(n)) {
+        ready.push_back(reinterpret_cast<std::size_t>(Poller::data(ev)));
+    }
+}
+
+ClientPoller::~ClientPoller() = default;
\ No newline at end of file
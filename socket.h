@@ -1,11 +1,16 @@
 #ifndef TERMCHAT_SOCKET_H
 #define TERMCHAT_SOCKET_H
 
+#include <chrono>
 #include <cstddef>
+#include <cstdint>
 #include <exception>
+#include <initializer_list>
 #include <memory>
 #include <span>
 #include <string>
+#include <utility>
+#include <vector>
 
 // A set of abstractions over the sockets API. It is not meant to be fully featured
 // but to only support the use-cases of the application.
@@ -27,10 +32,92 @@ public:
     bool bad_fd() const noexcept;
 };
 
+// The outcome of a call which reports failures instead of throwing them.
+enum class IoStatus {
+    Ok,
+    // Nothing could be transferred without blocking.
+    WouldBlock,
+    // The peer closed the connection, or reset it.
+    Closed,
+    // The call failed for another reason.
+    Error,
+};
+
+struct IoResult {
+    IoStatus status;
+    // Bytes transferred, which may be more than zero whatever the status.
+    std::size_t bytes = 0;
+    // The errno value behind an Error or a reset connection.
+    int error = 0;
+
+    bool ok() const noexcept { return status == IoStatus::Ok; }
+};
+
 class ServerClient;
 
+// An immutable message, cheap to copy: copies share the same bytes. This allows queueing
+// the same message for many clients without copying it for each of them.
+class Frame {
+private:
+    // The bytes share a single allocation with their reference count.
+    std::shared_ptr<const std::byte[]> m;
+    std::size_t m_size = 0;
+
+public:
+    Frame() = default;
+    // Copies the bytes.
+    explicit Frame(std::span<const std::byte> bytes);
+    // Copies the parts, one after the other.
+    explicit Frame(std::initializer_list<std::span<const std::byte>> parts);
+    // Shares bytes which something else keeps alive, such as a mapped file, without copying
+    // them.
+    Frame(std::shared_ptr<const std::byte[]> bytes, std::size_t size) noexcept
+        : m(std::move(bytes)), m_size(size) {}
+
+    // Returns a frame of some of the bytes, which shares them with this one.
+    Frame slice(std::size_t offset, std::size_t size) const noexcept;
+
+    std::span<const std::byte> bytes() const noexcept { return {m.get(), m_size}; }
+    std::size_t size() const noexcept { return m_size; }
+};
+
 enum class ServerClientStatus { New, PendingData };
 
+// The machinery a Server uses to wait for and move data.
+enum class ServerEngine {
+    // Readiness notifications (epoll or kqueue) followed by plain send/recv calls, with the
+    // sends of a poll() iteration gathered per client at the start of the next one.
+    Poll,
+    // Linux io_uring: multishot accept and recv into kernel-picked buffers, with all the
+    // sends of a poll() iteration submitted at once, at the start of the next one.
+    Uring,
+};
+
+// What to do with a client whose outgoing messages pile up faster than it reads them.
+enum class SlowClientPolicy {
+    // Discard the oldest messages which weren't started to be sent.
+    DropOldest,
+    // Make the send fail, as if the connection broke.
+    Disconnect,
+    // Stop receiving from the client until it catches up.
+    PauseReading,
+};
+
+struct ServerOptions {
+    ServerEngine engine = ServerEngine::Poll;
+    // Number of bytes queued for a client past which the slow client policy applies.
+    // Reading is resumed once the queue is at half of this.
+    std::size_t send_queue_limit = 1 << 20;
+    SlowClientPolicy slow_client_policy = SlowClientPolicy::Disconnect;
+    // Whether other sockets may listen on the same port, for example one per thread.
+    // The kernel then spreads incoming connections between them.
+    bool reuse_port = false;
+    // Number of connections the kernel completes and holds until they are accepted.
+    // Past it, new connections are dropped or refused. The kernel caps it at its own
+    // limit (net.core.somaxconn on Linux, kern.ipc.somaxconn on macOS).
+    int backlog = 1024;
+};
+
 struct ServerPollResult;
 
 class Server {
@@ -42,7 +129,9 @@ public:
     // Creates a new server which listens on the given port.
     // If the port is less than 1024 or another error occurs,
     // the constructor throws.
-    Server(unsigned short port);
+    // If the requested engine is not supported by the system,
+    // the server falls back to ServerEngine::Poll.
+    Server(unsigned short port, ServerOptions options = {});
 
     Server() = delete;
     Server(const Server&) = delete;
@@ -50,9 +139,19 @@ public:
     Server(Server&&) = default;
     Server& operator=(Server&&) = default;
 
-    // Polls the server for new connections and the given connections
-    // for data.
-    void poll(std::span<const ServerClient>, std::vector<ServerPollResult>&);
+    // Writes what was sent since the last call, then waits for new connections and for data
+    // on the connections accepted so far.
+    // Clients are watched from the moment they are accepted until they are closed,
+    // so there is no need to pass them on each call.
+    // It also returns, possibly without results, after a call to wake() or once the timeout
+    // passes, if it is not negative.
+    void poll(
+        std::vector<ServerPollResult>&,
+        std::chrono::milliseconds timeout = std::chrono::milliseconds(-1));
+    // Makes a poll() in progress or the next one return. Can be called from any thread.
+    void wake() noexcept;
+    // Returns the engine actually in use.
+    ServerEngine engine() const noexcept;
     // Closes the server and prevents any subsequent sends or recvs
     // on any of its ServerClients.
     // Multiple calls to shutdown() will throw an error.
@@ -83,14 +182,20 @@ public:
     virtual void send(std::span<const std::byte>) = 0;
 };
 
+// A connection accepted by a Server. Sends never block: messages are queued and reach the
+// network on the next Server::poll(), all those of a client together in as few system calls
+// as possible. What can't be written then is written as the client reads, so a failed send
+// is reported by a later send or recv. With ServerEngine::Uring, recv only returns data the
+// kernel has already delivered, always behaving as if the client was non-blocking.
 class ServerClient : public Receiver, public Sender {
 private:
     struct Private;
     std::shared_ptr<Private> m;
 
     friend class Server;
+    friend class Engine;
 
-    explicit ServerClient(Private*);
+    explicit ServerClient(std::shared_ptr<Private>);
 
 public:
     // This is required in order to be able to put it in a
@@ -102,9 +207,30 @@ public:
     ServerClient(ServerClient&&) = default;
     ServerClient& operator=(ServerClient&&) = default;
 
+    // Queues the bytes as one message, written by the next Server::poll().
+    // Throws if the connection failed or if the queue is over its limit and the
+    // policy is SlowClientPolicy::Disconnect.
     void send(std::span<const std::byte>) override;
+    // Same as above, without copying the bytes of the frame.
+    void send(Frame);
     bool recv(std::vector<std::byte>& res) override;
-
+    // Appends to the given buffer all the data that can be received without blocking,
+    // regardless of set_blocking(). Returns false if the client disconnected, in which
+    // case the data received before the disconnect is still appended.
+    // Throws if the receive fails.
+    bool recv_available(std::vector<std::byte>& buf);
+
+    // The same as send(), reporting failures instead of throwing them. The status is never
+    // IoStatus::WouldBlock, as what can't be written is queued. Going over the queue limit
+    // with SlowClientPolicy::Disconnect is an IoStatus::Error with ENOBUFS.
+    IoResult try_send(std::span<const std::byte>);
+    IoResult try_send(Frame);
+    // The same as recv_available(), reporting failures instead of throwing them.
+    // IoStatus::WouldBlock means that nothing was available.
+    IoResult try_recv(std::vector<std::byte>& buf);
+
+    // Clients are accepted non-blocking, in which case recv throws an error for which
+    // SocketError::would_block() is true when no data is available.
     void set_blocking(bool should_block);
 
     using ID = std::size_t;
@@ -115,6 +241,20 @@ public:
     // Returns the IP address of the client.
     std::string address() const noexcept;
 
+    // A value of the application's choosing, shared by all the copies of this ServerClient,
+    // for example to find the client's state without a lookup. It is zero until set.
+    void set_tag(std::uint64_t) noexcept;
+    std::uint64_t tag() const noexcept;
+
+    struct QueueStats {
+        // Messages not yet fully written, including a partially written one.
+        std::size_t messages;
+        std::size_t bytes;
+    };
+
+    // Returns how much is waiting to be written to this client.
+    QueueStats queued() const noexcept;
+
     // Closes the connection to this client.
     // Multiple calls to close() will throw an error.
     void close();
@@ -131,6 +271,11 @@ class Client : public Receiver, public Sender {
 private:
     int m_fd;
 
+    friend class ClientPoller;
+    friend class LocalServer;
+
+    explicit Client(int fd) noexcept : m_fd(fd) {}
+
 public:
     // Creates a client which connects to the given address.
     // Throws if a connection error occurs.
@@ -145,6 +290,15 @@ public:
     void send(std::span<const std::byte>) override;
     bool recv(std::vector<std::byte>& res) override;
 
+    // Sends what can be sent without blocking, which may be only part of the bytes.
+    IoResult try_send(std::span<const std::byte>);
+    // Appends to the given buffer all the data that can be received without blocking.
+    IoResult try_recv(std::vector<std::byte>& buf);
+
+    // Makes send and recv throw, with SocketError::would_block() true, once they are blocked
+    // for longer than the timeout. Zero, the default, means no limit.
+    void set_timeout(std::chrono::milliseconds);
+
     // Closes the connection to the server.
     // Multiple calls to close() will throw an error.
     void close();
@@ -152,4 +306,49 @@ public:
     ~Client();
 };
 
+// Listens on a Unix domain socket, for local tools rather than for chat clients. Connections
+// are accepted one at a time and blocking, as Clients.
+class LocalServer {
+private:
+    int m_fd;
+    std::string m_path;
+
+public:
+    // Replaces a socket left at the path by a previous run, but no other kind of file.
+    // Throws if the path can't be listened on.
+    explicit LocalServer(std::string path);
+
+    LocalServer(const LocalServer&) = delete;
+    LocalServer& operator=(const LocalServer&) = delete;
+
+    // Blocks until a connection comes. Throws if accepting fails.
+    Client accept();
+
+    // Stops listening and removes the socket file.
+    ~LocalServer();
+};
+
+// Waits for any of many Clients to have data, so that a single thread can drive lots of
+// connections, for example to load a server.
+class ClientPoller {
+private:
+    struct Private;
+    std::unique_ptr<Private> m;
+
+public:
+    ClientPoller();
+    ClientPoller(const ClientPoller&) = delete;
+    ClientPoller& operator=(const ClientPoller&) = delete;
+
+    // The client must stay open for as long as the poller is used. Throws if it can't be
+    // watched.
+    void add(const Client&, std::size_t tag);
+
+    // Waits until at least one client has data or has disconnected, for at most the given
+    // time, and replaces what ready holds with the tags of those clients.
+    void wait(std::vector<std::size_t>& ready, std::chrono::milliseconds timeout);
+
+    ~ClientPoller();
+};
+
 #endif
\ No newline at end of file
@@ -0,0 +1,374 @@
+#ifndef TERMCHAT_TEXT_H
+#define TERMCHAT_TEXT_H
+
+#include <algorithm>
+#include <array>
+#include <bit>
+#include <cstddef>
+#include <cstdint>
+#include <string_view>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define TERMCHAT_TEXT_X86 1
+#endif
+
+// Kernels for the text the server forwards, which scan 16 or 32 bytes at a time with SSE2 or
+// AVX2, whichever the CPU has, and one byte at a time elsewhere. Each takes its text where it
+// already is, such as the receive buffer, and none depends on the locale.
+namespace text {
+// What a byte that a terminal shouldn't get is replaced with: a control character, a DEL, or
+// a byte of invalid UTF-8. UTF-8 encoded C1 controls are replaced byte by byte.
+constexpr char replacement = '?';
+
+// Prefix of each line of an indented text.
+constexpr std::string_view indentation = "  ";
+
+enum class Isa {
+    Scalar,
+    Sse2,
+    Avx2,
+};
+
+namespace detail {
+// Bit i of a mask is about byte i of a block.
+struct Classes {
+    std::uint32_t newlines;
+    // Bytes which aren't printable ASCII nor a newline or a tab.
+    std::uint32_t others;
+};
+
+#ifdef TERMCHAT_TEXT_X86
+struct Sse2 {
+    static constexpr std::size_t width = 16;
+
+    static Classes classify(const char* p) noexcept {
+        const auto v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p));
+        const auto newlines = _mm_cmpeq_epi8(v, _mm_set1_epi8('\n'));
+        // Signed, so that the bytes from 0x80 on are below the space too.
+        const auto below_space = _mm_cmplt_epi8(v, _mm_set1_epi8(' '));
+        const auto allowed = _mm_or_si128(newlines, _mm_cmpeq_epi8(v, _mm_set1_epi8('\t')));
+        const auto others = _mm_or_si128(
+            _mm_andnot_si128(allowed, below_space), _mm_cmpeq_epi8(v, _mm_set1_epi8(0x7f)));
+        return {
+            .newlines = std::uint32_t(_mm_movemask_epi8(newlines)),
+            .others = std::uint32_t(_mm_movemask_epi8(others)),
+        };
+    }
+
+    static void copy(const char* from, char* to) noexcept {
+        _mm_storeu_si128(
+            reinterpret_cast<__m128i*>(to),
+            _mm_loadu_si128(reinterpret_cast<const __m128i*>(from)));
+    }
+
+    // Bytes in [a-z0-9_-].
+    static std::uint32_t user_name_chars(const char* p) noexcept {
+        const auto v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p));
+        const auto in = [&](char first, char last) {
+            return _mm_and_si128(
+                _mm_cmpgt_epi8(v, _mm_set1_epi8(first - 1)),
+                _mm_cmplt_epi8(v, _mm_set1_epi8(last + 1)));
+        };
+        const auto ok = _mm_or_si128(
+            _mm_or_si128(in('a', 'z'), in('0', '9')),
+            _mm_or_si128(
+                _mm_cmpeq_epi8(v, _mm_set1_epi8('-')), _mm_cmpeq_epi8(v, _mm_set1_epi8('_'))));
+        return _mm_movemask_epi8(ok);
+    }
+};
+
+struct Avx2 {
+    static constexpr std::size_t width = 32;
+
+    [[gnu::target("avx2")]] static Classes classify(const char* p) noexcept {
+        const auto v = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(p));
+        const auto newlines = _mm256_cmpeq_epi8(v, _mm256_set1_epi8('\n'));
+        const auto below_space = _mm256_cmpgt_epi8(_mm256_set1_epi8(' '), v);
+        const auto allowed =
+            _mm256_or_si256(newlines, _mm256_cmpeq_epi8(v, _mm256_set1_epi8('\t')));
+        const auto others = _mm256_or_si256(
+            _mm256_andnot_si256(allowed, below_space),
+            _mm256_cmpeq_epi8(v, _mm256_set1_epi8(0x7f)));
+        return {
+            .newlines = std::uint32_t(_mm256_movemask_epi8(newlines)),
+            .others = std::uint32_t(_mm256_movemask_epi8(others)),
+        };
+    }
+
+    [[gnu::target("avx2")]] static void copy(const char* from, char* to) noexcept {
+        _mm256_storeu_si256(
+            reinterpret_cast<__m256i*>(to),
+            _mm256_loadu_si256(reinterpret_cast<const __m256i*>(from)));
+    }
+
+    [[gnu::target("avx2")]] static std::uint32_t user_name_chars(const char* p) noexcept {
+        const auto v = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(p));
+        // No lambda as for SSE2: it wouldn't be compiled for AVX2.
+        const auto lower = _mm256_and_si256(
+            _mm256_cmpgt_epi8(v, _mm256_set1_epi8('a' - 1)),
+            _mm256_cmpgt_epi8(_mm256_set1_epi8('z' + 1), v));
+        const auto digit = _mm256_and_si256(
+            _mm256_cmpgt_epi8(v, _mm256_set1_epi8('0' - 1)),
+            _mm256_cmpgt_epi8(_mm256_set1_epi8('9' + 1), v));
+        const auto ok = _mm256_or_si256(
+            _mm256_or_si256(lower, digit),
+            _mm256_or_si256(
+                _mm256_cmpeq_epi8(v, _mm256_set1_epi8('-')),
+                _mm256_cmpeq_epi8(v, _mm256_set1_epi8('_'))));
+        return _mm256_movemask_epi8(ok);
+    }
+};
+#endif
+
+inline bool is_user_name_char(char c) noexcept {
+    return (c >= 'a' && c <= 'z') || (c >= '0' && c <= '9') || c == '-' || c == '_';
+}
+
+// Length of the valid UTF-8 sequence starting at s[0], which is not ASCII, or 0 if there is
+// none. C1 controls, U+0080 to U+009F, are not valid here.
+inline std::size_t utf8_sequence_size(std::string_view s) noexcept {
+    const auto b = [&](std::size_t i) { return std::uint8_t(s[i]); };
+    const auto is_continuation = [&](std::size_t i) {
+        return i < s.size() && (b(i) & 0xc0) == 0x80;
+    };
+
+    if (b(0) >= 0xc2 && b(0) <= 0xdf) {
+        return is_continuation(1) && !(b(0) == 0xc2 && b(1) < 0xa0) ? 2 : 0;
+    }
+    if (b(0) >= 0xe0 && b(0) <= 0xef) {
+        if (!is_continuation(1) || !is_continuation(2)) {
+            return 0;
+        }
+        // Overlong encodings and surrogates.
+        const bool is_valid = (b(0) != 0xe0 || b(1) >= 0xa0) && (b(0) != 0xed || b(1) < 0xa0);
+        return is_valid ? 3 : 0;
+    }
+    if (b(0) >= 0xf0 && b(0) <= 0xf4) {
+        if (!is_continuation(1) || !is_continuation(2) || !is_continuation(3)) {
+            return 0;
+        }
+        // Overlong encodings and code points past U+10FFFF.
+        const bool is_valid = (b(0) != 0xf0 || b(1) >= 0x90) && (b(0) != 0xf4 || b(1) < 0x90);
+        return is_valid ? 4 : 0;
+    }
+    return 0;
+}
+
+// Writes in[pos] and what follows it up to at least end, one character at a time, and
+// returns where it stopped, past end if a UTF-8 sequence crosses it.
+inline std::size_t
+write_indented_scalar(std::string_view in, std::size_t pos, std::size_t end, char*& out) {
+    while (pos < end) {
+        const auto c = in[pos];
+        if (c == '\n') {
+            *out++ = '\n';
+            out = std::copy(indentation.begin(), indentation.end(), out);
+            ++pos;
+        } else if ((c >= ' ' && c < 0x7f) || c == '\t') {
+            *out++ = c;
+            ++pos;
+        } else if (std::uint8_t(c) < 0x80) {
+            // A control character or DEL.
+            *out++ = replacement;
+            ++pos;
+        } else if (const auto n = utf8_sequence_size(in.substr(pos)); n > 0) {
+            out = std::copy_n(in.data() + pos, n, out);
+            pos += n;
+        } else {
+            *out++ = replacement;
+            ++pos;
+        }
+    }
+    return pos;
+}
+
+// Writes size bytes of printable text, whose newlines are the given bits, indenting the line
+// after each of them.
+inline char* write_lines(const char* p, std::size_t size, std::uint32_t newlines, char* out) {
+    std::size_t start = 0;
+    for (; newlines != 0; newlines &= newlines - 1) {
+        const std::size_t end = std::countr_zero(newlines) + 1;
+        out = std::copy(p + start, p + end, out);
+        out = std::copy(indentation.begin(), indentation.end(), out);
+        start = end;
+    }
+    return std::copy(p + start, p + size, out);
+}
+
+// Classes of the bytes from pos to the end, which are fewer than a block.
+template <class Vec>
+[[gnu::always_inline]] inline Classes classify_rest(std::string_view in, std::size_t pos) {
+    const auto shift = Vec::width - (in.size() - pos);
+    if (in.size() >= Vec::width) {
+        // The last block of the text, without the bytes before pos.
+        const auto classes = Vec::classify(in.data() + in.size() - Vec::width);
+        return {.newlines = classes.newlines >> shift, .others = classes.others >> shift};
+    }
+    // Padded with spaces, which are in no class.
+    std::array<char, Vec::width> rest;
+    rest.fill(' ');
+    std::copy(in.begin() + pos, in.end(), rest.begin());
+    return Vec::classify(rest.data());
+}
+
+template <class Vec>
+[[gnu::always_inline]] inline char* write_indented_blocks(std::string_view in, char* out) {
+    std::size_t pos = 0;
+    while (pos + Vec::width <= in.size()) {
+        const auto classes = Vec::classify(in.data() + pos);
+        if (classes.others != 0) {
+            // Rare in text typed in English, and the UTF-8 of other languages is checked one
+            // character at a time anyway.
+            pos = write_indented_scalar(in, pos, pos + Vec::width, out);
+        } else if (classes.newlines == 0) {
+            Vec::copy(in.data() + pos, out);
+            out += Vec::width;
+            pos += Vec::width;
+        } else if (pos + 2 * Vec::width <= in.size()) {
+            // Each line is written as a whole block from where it starts, the next one
+            // overwriting what the block wrote past the line. Enough of the text follows for
+            // the blocks to stay within the input and within what the output will hold.
+            std::size_t start = 0;
+            Vec::copy(in.data() + pos, out);
+            for (auto newlines = classes.newlines; newlines != 0; newlines &= newlines - 1) {
+                const std::size_t end = std::countr_zero(newlines) + 1;
+                out = std::copy(indentation.begin(), indentation.end(), out + end - start);
+                start = end;
+                Vec::copy(in.data() + pos + start, out);
+            }
+            out += Vec::width - start;
+            pos += Vec::width;
+        } else {
+            out = write_lines(in.data() + pos, Vec::width, classes.newlines, out);
+            pos += Vec::width;
+        }
+    }
+
+    if (pos == in.size()) {
+        return out;
+    }
+    const auto classes = classify_rest<Vec>(in, pos);
+    if (classes.others != 0) {
+        write_indented_scalar(in, pos, in.size(), out);
+        return out;
+    }
+    return write_lines(in.data() + pos, in.size() - pos, classes.newlines, out);
+}
+
+template <class Vec>
+[[gnu::always_inline]] inline std::size_t count_newlines_blocks(std::string_view in) {
+    std::size_t count = 0;
+    std::size_t pos = 0;
+    for (; pos + Vec::width <= in.size(); pos += Vec::width) {
+        count += std::popcount(Vec::classify(in.data() + pos).newlines);
+    }
+    if (pos < in.size()) {
+        count += std::popcount(classify_rest<Vec>(in, pos).newlines);
+    }
+    return count;
+}
+
+template <class Vec>
+[[gnu::always_inline]] inline bool is_user_name_blocks(std::string_view s) {
+    // Padded, so that a single block covers the longest user name.
+    std::array<char, 32> padded{};
+    const auto n = std::min(s.size(), padded.size());
+    std::copy_n(s.begin(), n, padded.begin());
+
+    std::uint64_t ok = 0;
+    for (std::size_t pos = 0; pos < n; pos += Vec::width) {
+        ok |= std::uint64_t(Vec::user_name_chars(padded.data() + pos)) << pos;
+    }
+    const auto all = (std::uint64_t(1) << n) - 1;
+    return (ok & all) == all &&
+           std::all_of(s.begin() + n, s.end(), [](char c) { return is_user_name_char(c); });
+}
+
+#ifdef TERMCHAT_TEXT_X86
+// Flattened, so that the kernels are compiled for the instruction set they are run on.
+[[gnu::flatten]] inline char* write_indented_sse2(std::string_view in, char* out) {
+    return write_indented_blocks<Sse2>(in, out);
+}
+[[gnu::target("avx2"), gnu::flatten]] inline char*
+write_indented_avx2(std::string_view in, char* out) {
+    return write_indented_blocks<Avx2>(in, out);
+}
+[[gnu::flatten]] inline std::size_t count_newlines_sse2(std::string_view in) {
+    return count_newlines_blocks<Sse2>(in);
+}
+[[gnu::target("avx2"), gnu::flatten]] inline std::size_t
+count_newlines_avx2(std::string_view in) {
+    return count_newlines_blocks<Avx2>(in);
+}
+[[gnu::flatten]] inline bool is_user_name_sse2(std::string_view s) {
+    return is_user_name_blocks<Sse2>(s);
+}
+[[gnu::target("avx2"), gnu::flatten]] inline bool is_user_name_avx2(std::string_view s) {
+    return is_user_name_blocks<Avx2>(s);
+}
+#endif
+
+inline Isa best_isa() noexcept {
+#ifdef TERMCHAT_TEXT_X86
+    return __builtin_cpu_supports("avx2") ? Isa::Avx2 : Isa::Sse2;
+#else
+    return Isa::Scalar;
+#endif
+}
+} // namespace detail
+
+// The best the CPU supports, picked when the program starts.
+inline const Isa isa = detail::best_isa();
+
+// Number of bytes write_indented() writes for the text.
+inline std::size_t indented_size(std::string_view in, Isa with = isa) {
+    std::size_t newlines = 0;
+    switch (with) {
+#ifdef TERMCHAT_TEXT_X86
+    case Isa::Avx2:
+        newlines = detail::count_newlines_avx2(in);
+        break;
+    case Isa::Sse2:
+        newlines = detail::count_newlines_sse2(in);
+        break;
+#endif
+    default:
+        newlines = std::count(in.begin(), in.end(), '\n');
+    }
+    return indentation.size() * (newlines + 1) + in.size();
+}
+
+// Writes the text to out with each of its lines indented, its bytes a terminal shouldn't get
+// replaced, and returns the end of what was written.
+inline char* write_indented(std::string_view in, char* out, Isa with = isa) {
+    out = std::copy(indentation.begin(), indentation.end(), out);
+    switch (with) {
+#ifdef TERMCHAT_TEXT_X86
+    case Isa::Avx2:
+        return detail::write_indented_avx2(in, out);
+    case Isa::Sse2:
+        return detail::write_indented_sse2(in, out);
+#endif
+    default:
+        detail::write_indented_scalar(in, 0, in.size(), out);
+        return out;
+    }
+}
+
+// Whether the text only holds characters of a user name, [a-z0-9_-].
+inline bool is_user_name(std::string_view s, Isa with = isa) {
+    switch (with) {
+#ifdef TERMCHAT_TEXT_X86
+    case Isa::Avx2:
+        return detail::is_user_name_avx2(s);
+    case Isa::Sse2:
+        return detail::is_user_name_sse2(s);
+#endif
+    default:
+        return std::all_of(s.begin(), s.end(), [](char c) { return detail::is_user_name_char(c); });
+    }
+}
+} // namespace text
+
+#endif // TERMCHAT_TEXT_H
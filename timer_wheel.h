@@ -0,0 +1,212 @@
+#ifndef TERMCHAT_TIMER_WHEEL_H
+#define TERMCHAT_TIMER_WHEEL_H
+
+#include <algorithm>
+#include <array>
+#include <bit>
+#include <cstdint>
+#include <optional>
+#include <utility>
+#include <vector>
+
+#include "slotmap.h"
+
+// Timers, each holding a value handed back when it expires, on a hierarchical timing wheel:
+// arming and cancelling a timer are constant time, whatever the number of timers, and so is
+// finding when the next one expires. Time is in ticks, of whatever unit the caller picks.
+//
+// Level l has 64 slots of 64^l ticks each. A timer goes to the lowest level whose current
+// rotation its deadline falls in, and moves down a level each time time reaches its slot,
+// until it reaches the first level, whose slots are single ticks. With 11 levels, every
+// 64-bit deadline falls in a rotation of the last one.
+template <class T> class TimerWheel {
+public:
+    using Handle = SlotHandle;
+
+private:
+    static constexpr unsigned slot_bits = 6;
+    static constexpr std::size_t slot_count = 1 << slot_bits;
+    static constexpr std::size_t level_count = 11;
+    static constexpr std::uint32_t none = UINT32_MAX;
+
+    struct Node {
+        T value{};
+        std::uint64_t deadline = 0;
+        // Neighbours in the list of the slot, or the next free node once expired.
+        std::uint32_t prev = none;
+        std::uint32_t next = none;
+        // Starts at one, so that a default constructed handle is never valid.
+        std::uint32_t generation = 1;
+        std::uint8_t level = 0;
+        std::uint8_t slot = 0;
+        bool is_armed = false;
+    };
+
+    // Nodes are reused rather than moved, so their indices stay valid for the lists.
+    std::vector<Node> m_nodes;
+    std::uint32_t m_free = none;
+    // Head of the list of each slot.
+    std::array<std::array<std::uint32_t, slot_count>, level_count> m_slots;
+    // A bit per slot which holds timers.
+    std::array<std::uint64_t, level_count> m_occupied{};
+    std::uint64_t m_now;
+    std::size_t m_size = 0;
+
+    static unsigned shift(std::size_t level) noexcept { return level * slot_bits; }
+
+    std::size_t index(std::uint64_t time, std::size_t level) const noexcept {
+        return (time >> shift(level)) & (slot_count - 1);
+    }
+
+    void link(std::uint32_t i) noexcept {
+        auto& node = m_nodes[i];
+        // The lowest level whose rotation holds both the deadline and now.
+        std::size_t level = 0;
+        while (level + 1 < level_count &&
+               (node.deadline >> shift(level + 1)) != (m_now >> shift(level + 1))) {
+            ++level;
+        }
+        const auto slot = index(node.deadline, level);
+
+        auto& head = m_slots[level][slot];
+        node.level = level;
+        node.slot = slot;
+        node.prev = none;
+        node.next = head;
+        if (head != none) {
+            m_nodes[head].prev = i;
+        }
+        head = i;
+        m_occupied[level] |= std::uint64_t(1) << slot;
+    }
+
+    void unlink(std::uint32_t i) noexcept {
+        auto& node = m_nodes[i];
+        if (node.prev != none) {
+            m_nodes[node.prev].next = node.next;
+        } else {
+            m_slots[node.level][node.slot] = node.next;
+            if (node.next == none) {
+                m_occupied[node.level] &= ~(std::uint64_t(1) << node.slot);
+            }
+        }
+        if (node.next != none) {
+            m_nodes[node.next].prev = node.prev;
+        }
+    }
+
+    // Unlinks the node and makes it free, returning its value.
+    T release(std::uint32_t i) noexcept {
+        unlink(i);
+        auto& node = m_nodes[i];
+        node.is_armed = false;
+        if (++node.generation == 0) {
+            node.generation = 1;
+        }
+        node.next = m_free;
+        m_free = i;
+        --m_size;
+        return std::exchange(node.value, T{});
+    }
+
+    // The first time from now on at which a slot is due: the slot of the first level fires
+    // its timers, those of the others move theirs down.
+    std::optional<std::uint64_t> next_due() const noexcept {
+        std::optional<std::uint64_t> due;
+        for (std::size_t level = 0; level < level_count; ++level) {
+            // Slots before the current one belong to the next rotation, which a timer only
+            // goes to from the level above. Only the first level's current slot can be due,
+            // holding timers armed for now or earlier.
+            const auto current = index(m_now, level);
+            const auto first = level == 0 ? current : current + 1;
+            if (first == slot_count) {
+                continue;
+            }
+            const auto slots = m_occupied[level] & (~std::uint64_t(0) << first);
+            if (slots == 0) {
+                continue;
+            }
+            const auto rotation = level + 1 < level_count
+                                      ? (m_now >> shift(level + 1)) << shift(level + 1)
+                                      : 0;
+            const auto time = std::max(
+                m_now, rotation | (std::uint64_t(std::countr_zero(slots)) << shift(level)));
+            if (!due.has_value() || time < *due) {
+                due = time;
+            }
+        }
+        return due;
+    }
+
+public:
+    explicit TimerWheel(std::uint64_t now = 0) : m_now(now) {
+        for (auto& level : m_slots) {
+            level.fill(none);
+        }
+    }
+
+    TimerWheel(const TimerWheel&) = delete;
+    TimerWheel& operator=(const TimerWheel&) = delete;
+
+    std::uint64_t now() const noexcept { return m_now; }
+    std::size_t size() const noexcept { return m_size; }
+
+    // A deadline already passed expires on the next call to advance().
+    Handle arm(std::uint64_t deadline, T value) {
+        std::uint32_t i;
+        if (m_free != none) {
+            i = m_free;
+            m_free = m_nodes[i].next;
+        } else {
+            i = m_nodes.size();
+            m_nodes.emplace_back();
+        }
+
+        auto& node = m_nodes[i];
+        node.value = std::move(value);
+        node.deadline = std::max(deadline, m_now);
+        node.is_armed = true;
+        link(i);
+        ++m_size;
+        return {.index = i, .generation = node.generation};
+    }
+
+    // Returns false if the timer expired or was cancelled already.
+    bool cancel(Handle handle) noexcept {
+        if (handle.index >= m_nodes.size() || !m_nodes[handle.index].is_armed ||
+            m_nodes[handle.index].generation != handle.generation) {
+            return false;
+        }
+        release(handle.index);
+        return true;
+    }
+
+    // A time at or before the next deadline, at which advance() should be called. It is the
+    // deadline itself if it is close enough, or when the timer gets nearer to it otherwise.
+    std::optional<std::uint64_t> next_expiry() const noexcept { return next_due(); }
+
+    // Moves time forward, passing the value of each timer whose deadline is reached to
+    // on_expired, which may arm and cancel timers.
+    template <class F> void advance(std::uint64_t now, F&& on_expired) {
+        for (auto due = next_due(); due.has_value() && *due <= now; due = next_due()) {
+            m_now = *due;
+
+            for (std::size_t level = level_count - 1; level > 0; --level) {
+                auto& head = m_slots[level][index(m_now, level)];
+                while (head != none) {
+                    const auto i = head;
+                    unlink(i);
+                    link(i);
+                }
+            }
+
+            auto& head = m_slots[0][index(m_now, 0)];
+            while (head != none) {
+                on_expired(release(head));
+            }
+        }
+        m_now = std::max(m_now, now);
+    }
+};
+
+#endif // TERMCHAT_TIMER_WHEEL_H
@@ -0,0 +1,231 @@
+#ifndef TERMCHAT_TRACE_H
+#define TERMCHAT_TRACE_H
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <exception>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+#include <unistd.h>
+
+// Records what the threads of the process spend their time on, as spans, for when the metrics
+// tell that something is slow but not where. Each thread records into a ring of its own, which
+// keeps its latest spans, and the rings are written out in the trace event format of Chrome,
+// which Perfetto and chrome://tracing open. Tracing is off until enabled: a span then costs a
+// relaxed load.
+namespace trace {
+// Spans kept per thread, the older ones being overwritten.
+constexpr std::size_t ring_capacity = 1 << 16;
+
+namespace detail {
+inline std::atomic<bool> is_enabled = false;
+
+inline std::uint64_t now() noexcept {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+               std::chrono::steady_clock::now().time_since_epoch())
+        .count();
+}
+
+struct Event {
+    const char* name;
+    std::uint64_t begin;
+    std::uint64_t end;
+};
+
+// Written by its thread only, and read by any thread while it is written: a reader copies the
+// events, then drops those which may have been overwritten while it did.
+class Ring {
+private:
+    struct Slot {
+        std::atomic<const char*> name;
+        std::atomic<std::uint64_t> begin;
+        std::atomic<std::uint64_t> end;
+    };
+
+    std::unique_ptr<Slot[]> m_slots = std::make_unique<Slot[]>(ring_capacity);
+    // Events recorded since the start, the next one going to m_head % ring_capacity.
+    std::atomic<std::uint64_t> m_head = 0;
+
+public:
+    void record(const Event& event) noexcept {
+        const auto head = m_head.load(std::memory_order_relaxed);
+        auto& slot = m_slots[head % ring_capacity];
+        // A reader which sees any of the stores below also sees that the slot is being reused.
+        std::atomic_thread_fence(std::memory_order_release);
+        slot.name.store(event.name, std::memory_order_relaxed);
+        slot.begin.store(event.begin, std::memory_order_relaxed);
+        slot.end.store(event.end, std::memory_order_relaxed);
+        m_head.store(head + 1, std::memory_order_release);
+    }
+
+    // Appends the events to out, oldest first.
+    void copy(std::vector<Event>& out) const {
+        const auto head = m_head.load(std::memory_order_acquire);
+        const auto first = head > ring_capacity ? head - ring_capacity : 0;
+        const auto start = out.size();
+        for (auto i = first; i < head; ++i) {
+            const auto& slot = m_slots[i % ring_capacity];
+            out.push_back({
+                .name = slot.name.load(std::memory_order_relaxed),
+                .begin = slot.begin.load(std::memory_order_relaxed),
+                .end = slot.end.load(std::memory_order_relaxed),
+            });
+        }
+
+        std::atomic_thread_fence(std::memory_order_acquire);
+        // The slot of the event being written, if any, was that of the event at head - capacity.
+        const auto now_head = m_head.load(std::memory_order_relaxed);
+        const auto overwritten = now_head >= ring_capacity ? now_head - ring_capacity + 1 : 0;
+        if (overwritten > first) {
+            const auto n = std::min<std::uint64_t>(overwritten - first, head - first);
+            out.erase(out.begin() + start, out.begin() + start + n);
+        }
+    }
+};
+
+struct Thread {
+    std::uint64_t id;
+    std::string name;
+    Ring ring;
+};
+
+// All the threads which recorded something, guarded by threads_mutex. They are kept after
+// their thread exits, for what they recorded.
+inline std::mutex threads_mutex;
+inline std::vector<std::shared_ptr<Thread>> threads;
+
+// Only set once the thread is named or records something, so that its ring is not allocated
+// before.
+inline thread_local std::shared_ptr<Thread> current;
+
+inline Thread& this_thread() {
+    if (current == nullptr) {
+        auto thread = std::make_shared<Thread>();
+        const std::lock_guard lock(threads_mutex);
+        thread->id = threads.size() + 1;
+        threads.push_back(thread);
+        current = std::move(thread);
+    }
+    return *current;
+}
+
+inline void append_escaped(std::string& out, std::string_view s) {
+    for (const char c : s) {
+        if (c == '"' || c == '\\') {
+            out += '\\';
+        }
+        out += static_cast<unsigned char>(c) < 0x20 ? ' ' : c;
+    }
+}
+
+// Microseconds, the unit of the format, with the nanoseconds as decimals.
+inline void append_us(std::string& out, std::uint64_t ns) {
+    const auto decimals = std::to_string(ns % 1000);
+    out.append(std::to_string(ns / 1000)).append(".");
+    out.append(3 - decimals.size(), '0').append(decimals);
+}
+} // namespace detail
+
+inline bool is_enabled() noexcept { return detail::is_enabled.load(std::memory_order_relaxed); }
+
+// Can be called from any thread. Spans in progress when tracing is enabled are not recorded,
+// those in progress when it is disabled are.
+inline void enable(bool should_enable) noexcept {
+    detail::is_enabled.store(should_enable, std::memory_order_relaxed);
+}
+
+// Names the calling thread in the traces. This also allocates the ring it records into, which
+// its spans would otherwise do on their way out.
+inline void name_thread(std::string name) {
+    auto& thread = detail::this_thread();
+    const std::lock_guard lock(detail::threads_mutex);
+    thread.name = std::move(name);
+}
+
+// Records the time from its construction to its destruction under the given name, which must
+// outlive the process' traces: a string literal.
+class Span {
+private:
+    const char* m_name;
+    // Zero if tracing was off.
+    std::uint64_t m_begin;
+
+public:
+    explicit Span(const char* name) noexcept
+        : m_name(name), m_begin(is_enabled() ? detail::now() : 0) {}
+
+    Span(const Span&) = delete;
+    Span& operator=(const Span&) = delete;
+
+    ~Span() {
+        if (m_begin == 0) {
+            return;
+        }
+        try {
+            detail::this_thread().ring.record(
+                {.name = m_name, .begin = m_begin, .end = detail::now()});
+        } catch (const std::exception&) {
+            // Only a thread which wasn't named gets here, failing to allocate its ring: the span
+            // is dropped.
+        }
+    }
+};
+
+// Writes what the threads recorded, as a JSON document in the trace event format of Chrome.
+inline std::string to_chrome_json() {
+    std::vector<std::pair<std::shared_ptr<detail::Thread>, std::string>> threads;
+    {
+        const std::lock_guard lock(detail::threads_mutex);
+        for (const auto& thread : detail::threads) {
+            threads.emplace_back(thread, thread->name);
+        }
+    }
+
+    const auto pid = std::to_string(getpid());
+    std::string out = "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n";
+    bool is_first = true;
+    const auto begin_event = [&](std::string_view name, std::string_view phase, std::uint64_t tid) {
+        if (!is_first) {
+            out += ",\n";
+        }
+        is_first = false;
+        out.append("{\"name\":\"");
+        detail::append_escaped(out, name);
+        out.append("\",\"ph\":\"").append(phase).append("\",\"pid\":").append(pid);
+        out.append(",\"tid\":").append(std::to_string(tid));
+    };
+
+    std::vector<detail::Event> events;
+    for (const auto& [thread, name] : threads) {
+        if (!name.empty()) {
+            begin_event("thread_name", "M", thread->id);
+            out.append(",\"args\":{\"name\":\"");
+            detail::append_escaped(out, name);
+            out.append("\"}}");
+        }
+
+        events.clear();
+        thread->ring.copy(events);
+        for (const auto& event : events) {
+            begin_event(event.name, "X", thread->id);
+            out.append(",\"ts\":");
+            detail::append_us(out, event.begin);
+            out.append(",\"dur\":");
+            detail::append_us(out, event.end - event.begin);
+            out.append("}");
+        }
+    }
+    out.append("\n]}\n");
+    return out;
+}
+} // namespace trace
+
+#endif // TERMCHAT_TRACE_H
@@ -0,0 +1,748 @@
+#ifdef __linux__
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <memory>
+#include <span>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <sys/utsname.h>
+#include <unistd.h>
+
+#include "engine.h"
+#include "socket.h"
+#include "trace.h"
+
+// A minimal io_uring driver written against the raw kernel interface, so that no
+// library is needed. It only implements what the server needs: multishot accept,
+// multishot recv into a ring of provided buffers, gathered sends and cancellation.
+
+static int io_uring_setup(unsigned entries, io_uring_params* p) {
+    return (int)syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int io_uring_enter(
+    int fd, unsigned to_submit, unsigned min_complete, unsigned flags, void* arg = nullptr,
+    std::size_t arg_size = 0) {
+    return (int)syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, arg, arg_size);
+}
+
+static int io_uring_register(int fd, unsigned opcode, void* arg, unsigned nr_args) {
+    return (int)syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+// Multishot recv is the newest of the features used, available since Linux 6.0.
+static bool kernel_supports_multishot_recv() {
+    utsname u;
+    if (uname(&u) == -1) {
+        return false;
+    }
+    int major = 0;
+    if (sscanf(u.release, "%d.", &major) != 1) {
+        return false;
+    }
+    return major >= 6;
+}
+
+class Ring {
+private:
+    int m_fd;
+
+    void* m_sq_ptr;
+    std::size_t m_sq_size;
+    void* m_cq_ptr;
+    std::size_t m_cq_size;
+    io_uring_sqe* m_sqes;
+    std::size_t m_sqes_size;
+
+    unsigned* m_sq_head;
+    unsigned* m_sq_tail;
+    unsigned m_sq_mask;
+    unsigned m_sq_entries;
+    unsigned* m_sq_array;
+    unsigned m_sq_local_tail;
+
+    unsigned* m_cq_head;
+    unsigned* m_cq_tail;
+    unsigned m_cq_mask;
+    io_uring_cqe* m_cqes;
+
+    template <class T> static T* at(void* base, std::size_t off) {
+        return reinterpret_cast<T*>(static_cast<char*>(base) + off);
+    }
+
+public:
+    // Throws if the ring can't be created. The caller is expected to fall back.
+    Ring(unsigned entries, unsigned cq_entries) : m_sq_local_tail(0) {
+        io_uring_params p{};
+        p.flags = IORING_SETUP_CQSIZE;
+        p.cq_entries = cq_entries;
+
+        m_fd = io_uring_setup(entries, &p);
+        if (m_fd < 0) {
+            throw SocketError("io_uring_setup", strerror(errno));
+        }
+
+        m_sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+        m_cq_size = p.cq_off.cqes + p.cq_entries * sizeof(io_uring_cqe);
+        if (p.features & IORING_FEAT_SINGLE_MMAP) {
+            m_sq_size = m_cq_size = std::max(m_sq_size, m_cq_size);
+        }
+
+        m_sq_ptr = mmap(
+            nullptr, m_sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, m_fd,
+            IORING_OFF_SQ_RING);
+        if (m_sq_ptr == MAP_FAILED) {
+            ::close(m_fd);
+            throw SocketError("mmap", strerror(errno));
+        }
+
+        if (p.features & IORING_FEAT_SINGLE_MMAP) {
+            m_cq_ptr = m_sq_ptr;
+        } else {
+            m_cq_ptr = mmap(
+                nullptr, m_cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, m_fd,
+                IORING_OFF_CQ_RING);
+            if (m_cq_ptr == MAP_FAILED) {
+                munmap(m_sq_ptr, m_sq_size);
+                ::close(m_fd);
+                throw SocketError("mmap", strerror(errno));
+            }
+        }
+
+        m_sqes_size = p.sq_entries * sizeof(io_uring_sqe);
+        const auto sqes = mmap(
+            nullptr, m_sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, m_fd,
+            IORING_OFF_SQES);
+        if (sqes == MAP_FAILED) {
+            if (m_cq_ptr != m_sq_ptr) {
+                munmap(m_cq_ptr, m_cq_size);
+            }
+            munmap(m_sq_ptr, m_sq_size);
+            ::close(m_fd);
+            throw SocketError("mmap", strerror(errno));
+        }
+        m_sqes = static_cast<io_uring_sqe*>(sqes);
+
+        m_sq_head = at<unsigned>(m_sq_ptr, p.sq_off.head);
+        m_sq_tail = at<unsigned>(m_sq_ptr, p.sq_off.tail);
+        m_sq_mask = *at<unsigned>(m_sq_ptr, p.sq_off.ring_mask);
+        m_sq_entries = *at<unsigned>(m_sq_ptr, p.sq_off.ring_entries);
+        m_sq_array = at<unsigned>(m_sq_ptr, p.sq_off.array);
+        m_sq_local_tail = *m_sq_tail;
+
+        m_cq_head = at<unsigned>(m_cq_ptr, p.cq_off.head);
+        m_cq_tail = at<unsigned>(m_cq_ptr, p.cq_off.tail);
+        m_cq_mask = *at<unsigned>(m_cq_ptr, p.cq_off.ring_mask);
+        m_cqes = at<io_uring_cqe>(m_cq_ptr, p.cq_off.cqes);
+    }
+
+    Ring(const Ring&) = delete;
+    Ring& operator=(const Ring&) = delete;
+
+    int fd() const noexcept { return m_fd; }
+
+    // Returns a zeroed submission queue entry. Entries are handed to the kernel
+    // by the next call to submit(), which happens here only if the queue is full.
+    io_uring_sqe& next_sqe() {
+        const auto head = std::atomic_ref(*m_sq_head).load(std::memory_order_acquire);
+        if (m_sq_local_tail - head == m_sq_entries) {
+            submit(false);
+        }
+
+        const auto idx = m_sq_local_tail & m_sq_mask;
+        m_sq_array[idx] = idx;
+        ++m_sq_local_tail;
+
+        auto& sqe = m_sqes[idx];
+        std::memset(&sqe, 0, sizeof sqe);
+        return sqe;
+    }
+
+    // Submits all queued entries with a single system call, waiting for at least
+    // one completion if asked to, for at most the timeout if it is not negative.
+    void submit(bool wait, std::chrono::milliseconds timeout = std::chrono::milliseconds(-1)) {
+        const auto to_submit = m_sq_local_tail - *m_sq_tail;
+        std::atomic_ref(*m_sq_tail).store(m_sq_local_tail, std::memory_order_release);
+
+        if (to_submit == 0 && !wait) {
+            return;
+        }
+
+        // Timeouts are passed as an extended argument, available since Linux 5.11.
+        const __kernel_timespec ts{
+            .tv_sec = timeout.count() / 1000, .tv_nsec = (timeout.count() % 1000) * 1'000'000};
+        io_uring_getevents_arg arg{};
+        arg.ts = reinterpret_cast<std::uint64_t>(&ts);
+        const bool has_timeout = wait && timeout.count() >= 0;
+
+        for (;;) {
+            const auto n = io_uring_enter(
+                m_fd, to_submit, wait ? 1 : 0,
+                (wait ? IORING_ENTER_GETEVENTS : 0) | (has_timeout ? IORING_ENTER_EXT_ARG : 0),
+                has_timeout ? &arg : nullptr, has_timeout ? sizeof arg : 0);
+            if (n >= 0 || (has_timeout && errno == ETIME)) {
+                return;
+            }
+            if (errno != EINTR) {
+                throw SocketError("io_uring_enter", strerror(errno));
+            }
+        }
+    }
+
+    // Calls the given function for each available completion and marks them seen.
+    template <class F> void for_each_cqe(F&& f) {
+        auto head = *m_cq_head;
+        const auto tail = std::atomic_ref(*m_cq_tail).load(std::memory_order_acquire);
+        for (; head != tail; ++head) {
+            f(m_cqes[head & m_cq_mask]);
+        }
+        std::atomic_ref(*m_cq_head).store(head, std::memory_order_release);
+    }
+
+    ~Ring() {
+        munmap(m_sqes, m_sqes_size);
+        if (m_cq_ptr != m_sq_ptr) {
+            munmap(m_cq_ptr, m_cq_size);
+        }
+        munmap(m_sq_ptr, m_sq_size);
+        ::close(m_fd);
+    }
+};
+
+// A ring of equally sized buffers from which the kernel picks one for each multishot
+// recv completion. A buffer is given back to the kernel once its data was copied out.
+class BufferRing {
+private:
+    Ring& m_ring;
+    io_uring_buf_ring* m_br;
+    std::size_t m_br_size;
+    std::vector<std::byte> m_storage;
+    unsigned m_count;
+    unsigned m_buf_size;
+    uint16_t m_tail;
+
+public:
+    static constexpr uint16_t group_id = 0;
+
+    // The count must be a power of two.
+    // Throws if the kernel doesn't support provided buffer rings.
+    BufferRing(Ring& ring, unsigned count, unsigned buf_size)
+        : m_ring(ring), m_storage(std::size_t(count) * buf_size), m_count(count),
+          m_buf_size(buf_size), m_tail(0) {
+        m_br_size = count * sizeof(io_uring_buf);
+        const auto br = mmap(
+            nullptr, m_br_size, PROT_READ | PROT_WRITE, MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+        if (br == MAP_FAILED) {
+            throw SocketError("mmap", strerror(errno));
+        }
+        m_br = static_cast<io_uring_buf_ring*>(br);
+        m_br->tail = 0;
+
+        io_uring_buf_reg reg{};
+        reg.ring_addr = reinterpret_cast<uint64_t>(m_br);
+        reg.ring_entries = count;
+        reg.bgid = group_id;
+        if (const auto r = io_uring_register(m_ring.fd(), IORING_REGISTER_PBUF_RING, &reg, 1);
+            r < 0) {
+            munmap(m_br, m_br_size);
+            throw SocketError("io_uring_register", strerror(errno));
+        }
+
+        for (unsigned i = 0; i < count; ++i) {
+            put(i);
+        }
+        publish();
+    }
+
+    BufferRing(const BufferRing&) = delete;
+    BufferRing& operator=(const BufferRing&) = delete;
+
+    std::span<const std::byte> get(unsigned id, std::size_t len) const noexcept {
+        return std::span(m_storage).subspan(std::size_t(id) * m_buf_size, len);
+    }
+
+    // Queues the buffer with the given ID for reuse. It is visible to the kernel
+    // after the next publish().
+    void put(unsigned id) noexcept {
+        // Not m_br->bufs: the kernel header declares it as a flexible array member wrapped
+        // in a union, which C++ lays out at a different offset than C does.
+        auto& b = reinterpret_cast<io_uring_buf*>(m_br)[m_tail & (m_count - 1)];
+        b.addr = reinterpret_cast<uint64_t>(m_storage.data() + std::size_t(id) * m_buf_size);
+        b.len = m_buf_size;
+        b.bid = id;
+        ++m_tail;
+    }
+
+    void publish() noexcept {
+        std::atomic_ref(m_br->tail).store(m_tail, std::memory_order_release);
+    }
+
+    ~BufferRing() {
+        io_uring_buf_reg reg{};
+        reg.bgid = group_id;
+        (void)io_uring_register(m_ring.fd(), IORING_UNREGISTER_PBUF_RING, &reg, 1);
+        munmap(m_br, m_br_size);
+    }
+};
+
+class UringEngine : public Engine {
+private:
+    // State of a connection, owned by the engine. It outlives its ServerClient for as long
+    // as operations referring to it are still in flight in the kernel.
+    struct Connection {
+        int fd;
+        // Null once the ServerClient was closed.
+        ClientState* owner;
+
+        // Received and not yet consumed bytes, starting at in_pos.
+        std::vector<std::byte> in;
+        std::size_t in_pos;
+        bool eof;
+
+        // The queue of the closed ServerClient, which holds the data of the send in flight.
+        OutboundQueue out_after_close;
+        // What the send in flight writes.
+        msghdr msg;
+        std::array<iovec, max_gather> iov;
+
+        bool recv_armed;
+        bool send_armed;
+        // Whether the connection is in the list of sends to arm before the next submission.
+        bool is_unsent;
+        // Number of submitted operations whose completion wasn't yet seen.
+        int inflight;
+
+        // Whether the connection is already in the list of clients to report.
+        bool is_ready;
+        bool is_new;
+    };
+
+    // Connections are aligned enough for the operation to fit in the low bits of their address.
+    enum Op : uint64_t { Accept = 0, Recv = 1, Send = 2, Cancel = 3, Wake = 4 };
+    static constexpr uint64_t op_mask = 7;
+    static_assert(alignof(Connection) > op_mask);
+
+    static uint64_t user_data(Connection* c, Op op) noexcept {
+        return reinterpret_cast<uint64_t>(c) | op;
+    }
+
+    int m_fd;
+    ServerOptions m_options;
+    ServerClient::ID m_next_id;
+    Ring m_ring;
+    BufferRing m_buffers;
+    bool m_accept_armed;
+    bool m_is_shut_down;
+    Notifier m_notifier;
+    // Where the read of the notifier puts the counter, which is of no interest.
+    uint64_t m_notifier_buf;
+
+    std::unordered_map<Connection*, std::unique_ptr<Connection>> m_connections;
+    // Connections to report on the next poll(), gathered while processing completions
+    // and while the server consumes data.
+    std::vector<Connection*> m_ready;
+    // Connections with sends to arm before the next submission.
+    std::vector<Connection*> m_unsent;
+    // Clients accepted during the current poll(), kept alive until they are reported.
+    std::vector<std::shared_ptr<ClientState>> m_accepted;
+
+    void arm_accept() {
+        auto& sqe = m_ring.next_sqe();
+        sqe.opcode = IORING_OP_ACCEPT;
+        sqe.fd = m_fd;
+        sqe.ioprio = IORING_ACCEPT_MULTISHOT;
+        sqe.accept_flags = SOCK_CLOEXEC;
+        sqe.user_data = user_data(nullptr, Accept);
+        m_accept_armed = true;
+    }
+
+    void arm_wake() {
+        auto& sqe = m_ring.next_sqe();
+        sqe.opcode = IORING_OP_READ;
+        sqe.fd = m_notifier.fd();
+        sqe.addr = reinterpret_cast<uint64_t>(&m_notifier_buf);
+        sqe.len = sizeof m_notifier_buf;
+        sqe.user_data = user_data(nullptr, Wake);
+    }
+
+    void arm_recv(Connection& c) {
+        auto& sqe = m_ring.next_sqe();
+        sqe.opcode = IORING_OP_RECV;
+        sqe.fd = c.fd;
+        sqe.ioprio = IORING_RECV_MULTISHOT;
+        sqe.flags = IOSQE_BUFFER_SELECT;
+        sqe.buf_group = BufferRing::group_id;
+        sqe.user_data = user_data(&c, Recv);
+        c.recv_armed = true;
+        ++c.inflight;
+    }
+
+    void cancel_recv(Connection& c) {
+        auto& sqe = m_ring.next_sqe();
+        sqe.opcode = IORING_OP_ASYNC_CANCEL;
+        sqe.addr = user_data(&c, Recv);
+        sqe.user_data = user_data(&c, Cancel);
+        ++c.inflight;
+    }
+
+    // Sends as many queued messages as fit in a single operation.
+    void arm_send(Connection& c) {
+        c.msg = msghdr{};
+        c.msg.msg_iov = c.iov.data();
+        c.msg.msg_iovlen = c.owner->out.gather(c.iov);
+
+        auto& sqe = m_ring.next_sqe();
+        sqe.opcode = IORING_OP_SENDMSG;
+        sqe.fd = c.fd;
+        sqe.addr = reinterpret_cast<uint64_t>(&c.msg);
+        sqe.len = 1;
+        sqe.msg_flags =
+            MSG_NOSIGNAL | (c.owner->out.stats().messages > c.msg.msg_iovlen ? more_flag : 0);
+        sqe.user_data = user_data(&c, Send);
+        c.send_armed = true;
+        ++c.inflight;
+    }
+
+    // Arms the send right before the next submission rather than now, so that it also
+    // carries what is queued in the meantime.
+    void schedule_send(Connection& c) {
+        if (!c.is_unsent) {
+            c.is_unsent = true;
+            m_unsent.push_back(&c);
+        }
+    }
+
+    void mark_ready(Connection& c) {
+        if (c.owner != nullptr && !c.is_ready) {
+            c.is_ready = true;
+            m_ready.push_back(&c);
+        }
+    }
+
+    void release_if_done(Connection& c) {
+        if (c.owner == nullptr && c.inflight == 0) {
+            ::close(c.fd);
+            m_connections.erase(&c);
+        }
+    }
+
+    void on_accept(const io_uring_cqe& cqe) {
+        if (!(cqe.flags & IORING_CQE_F_MORE)) {
+            m_accept_armed = false;
+        }
+        if (cqe.res < 0) {
+            // Transient failures (e.g. out of file descriptors) shouldn't stop the server
+            // from accepting once the situation improves.
+            if (!m_accept_armed && !m_is_shut_down && cqe.res != -ECANCELED) {
+                arm_accept();
+            }
+            return;
+        }
+
+        auto c = std::make_unique<Connection>();
+        c->fd = cqe.res;
+        disable_nagle(c->fd);
+
+        sockaddr_storage addr{};
+        socklen_t sz = sizeof addr;
+        (void)getpeername(c->fd, (sockaddr*)&addr, &sz);
+
+        auto p = std::make_shared<ClientState>(
+            c->fd, ++m_next_id, addr, shared_from_this(), c.get());
+        c->owner = p.get();
+        c->is_new = true;
+
+        // The Private is kept alive by the poll result until the server takes it over.
+        m_accepted.push_back(std::move(p));
+        arm_recv(*c);
+        mark_ready(*c);
+        m_connections.emplace(c.get(), std::move(c));
+
+        if (!m_accept_armed && !m_is_shut_down) {
+            arm_accept();
+        }
+    }
+
+    void on_recv(Connection& c, const io_uring_cqe& cqe) {
+        const bool more = cqe.flags & IORING_CQE_F_MORE;
+        if (!more) {
+            c.recv_armed = false;
+            --c.inflight;
+        }
+
+        if (cqe.res > 0) {
+            const unsigned id = cqe.flags >> IORING_CQE_BUFFER_SHIFT;
+            if (c.owner != nullptr) {
+                const auto data = m_buffers.get(id, cqe.res);
+                c.in.insert(c.in.end(), data.begin(), data.end());
+            }
+            m_buffers.put(id);
+            mark_ready(c);
+        } else if (cqe.res == 0) {
+            c.eof = true;
+            mark_ready(c);
+        } else if (cqe.res != -ENOBUFS && cqe.res != -ECANCELED && c.owner != nullptr) {
+            c.owner->error = -cqe.res;
+            mark_ready(c);
+        }
+
+        // Multishot recv stops when it runs out of buffers: buffers are given back while
+        // processing this batch of completions, so it is safe to rearm right away.
+        // It is also stopped on purpose while the client is paused.
+        if (!c.recv_armed && c.owner != nullptr && !c.eof && c.owner->error == 0 &&
+            !c.owner->is_paused) {
+            arm_recv(c);
+        }
+        release_if_done(c);
+    }
+
+    void on_send(Connection& c, const io_uring_cqe& cqe) {
+        c.send_armed = false;
+        --c.inflight;
+
+        if (c.owner == nullptr) {
+            release_if_done(c);
+            return;
+        }
+
+        if (cqe.res < 0) {
+            if (cqe.res != -ECANCELED) {
+                c.owner->error = -cqe.res;
+                mark_ready(c);
+            }
+            return;
+        }
+
+        c.owner->out.consume(cqe.res);
+        if (!c.owner->out.empty()) {
+            schedule_send(c);
+        }
+        if (update_paused(*c.owner, m_options)) {
+            if (!c.recv_armed) {
+                arm_recv(c);
+            }
+            mark_ready(c);
+        }
+    }
+
+public:
+    UringEngine(int listen_fd, const ServerOptions& options)
+        : m_fd(listen_fd), m_options(options), m_next_id(0), m_ring(256, 4096),
+          m_buffers(m_ring, 256, 4096),
+          m_accept_armed(false), m_is_shut_down(false) {
+        arm_accept();
+        arm_wake();
+    }
+
+    ServerEngine kind() const noexcept override { return ServerEngine::Uring; }
+
+    void poll(std::vector<ServerPollResult>& res, std::chrono::milliseconds timeout) override {
+        res.resize(0);
+
+        {
+            const trace::Span span("flush");
+            for (auto c : m_unsent) {
+                c->is_unsent = false;
+                if (c->owner != nullptr && !c->send_armed && !c->owner->out.empty()) {
+                    arm_send(*c);
+                }
+            }
+            m_unsent.clear();
+        }
+
+        {
+            // Connections that still have buffered data after the server consumed some of
+            // it are reported again without waiting for the kernel.
+            const trace::Span span("wait");
+            m_ring.submit(m_ready.empty(), timeout);
+        }
+
+        const trace::Span span("complete");
+        m_ring.for_each_cqe([this](const io_uring_cqe& cqe) {
+            const auto op = Op(cqe.user_data & op_mask);
+            const auto c = reinterpret_cast<Connection*>(cqe.user_data & ~op_mask);
+            switch (op) {
+            case Accept:
+                on_accept(cqe);
+                break;
+            case Recv:
+                on_recv(*c, cqe);
+                break;
+            case Send:
+                on_send(*c, cqe);
+                break;
+            case Cancel:
+                --c->inflight;
+                release_if_done(*c);
+                break;
+            case Wake:
+                arm_wake();
+                break;
+            }
+        });
+        m_buffers.publish();
+
+        for (auto c : m_ready) {
+            c->is_ready = false;
+            if (c->owner == nullptr) {
+                continue;
+            }
+            const auto status = c->is_new ? ServerClientStatus::New
+                                          : ServerClientStatus::PendingData;
+            c->is_new = false;
+            res.push_back(ServerPollResult{
+                .client = make_client(c->owner->shared_from_this()), .status = status});
+        }
+        m_ready.clear();
+        m_accepted.clear();
+    }
+
+    void wake() noexcept override { m_notifier.notify(); }
+
+    void shutdown() override {
+        m_is_shut_down = true;
+        if (::shutdown(m_fd, 2 /* further sends and recvs are disallowed */) == -1) {
+            throw SocketError("shutdown", strerror(errno));
+        }
+    }
+
+    IoResult try_send(ClientState& p, Frame data) override {
+        auto& c = *static_cast<Connection*>(p.conn);
+        if (p.error != 0) {
+            return io_failure(p.error);
+        }
+        const auto size = data.size();
+        if (!p.out.push(std::move(data), m_options)) {
+            return {.status = IoStatus::Error, .error = ENOBUFS};
+        }
+
+        // Resuming is left to the send completions, once the queue gets shorter.
+        const auto was_paused = p.is_paused;
+        (void)update_paused(p, m_options);
+        if (!was_paused && p.is_paused && c.recv_armed) {
+            cancel_recv(c);
+        }
+
+        if (!c.send_armed) {
+            schedule_send(c);
+        }
+        return {.status = IoStatus::Ok, .bytes = size};
+    }
+
+    bool recv(ClientState& p, std::vector<std::byte>& res) override {
+        auto& c = *static_cast<Connection*>(p.conn);
+        const auto available = c.in.size() - c.in_pos;
+
+        if (available < res.size()) {
+            // A failed connection can't be used anymore, so it is reported as a disconnect.
+            if (c.eof || p.error != 0) {
+                return false;
+            }
+            errno = EAGAIN;
+            throw SocketError("recv", strerror(errno));
+        }
+
+        const auto first = c.in.begin() + c.in_pos;
+        std::copy(first, first + res.size(), res.begin());
+        c.in_pos += res.size();
+
+        if (c.in_pos == c.in.size()) {
+            c.in.clear();
+            c.in_pos = 0;
+        } else {
+            // The server consumes one message at a time, so there may be more to process.
+            mark_ready(c);
+        }
+        return true;
+    }
+
+    IoResult try_recv(ClientState& p, std::vector<std::byte>& buf) override {
+        auto& c = *static_cast<Connection*>(p.conn);
+        const auto in = std::span(c.in).subspan(c.in_pos);
+        const auto bytes = in.size();
+
+        // What was received before pausing is handed out once the client is resumed.
+        if (p.is_paused && p.error == 0) {
+            return {.status = IoStatus::WouldBlock};
+        }
+
+        if (buf.empty() && c.in_pos == 0) {
+            std::swap(buf, c.in);
+        } else {
+            buf.insert(buf.end(), in.begin(), in.end());
+        }
+        c.in.clear();
+        c.in_pos = 0;
+
+        if (p.error != 0) {
+            return io_failure(p.error, bytes);
+        } else if (c.eof) {
+            return {.status = IoStatus::Closed, .bytes = bytes};
+        }
+        return {.status = bytes > 0 ? IoStatus::Ok : IoStatus::WouldBlock, .bytes = bytes};
+    }
+
+    // Reads never block with this engine, so there's nothing to change.
+    void set_blocking(ClientState&, bool) override {}
+
+    void close(ClientState& p) override {
+        auto& c = *static_cast<Connection*>(p.conn);
+        c.owner = nullptr;
+        c.in.clear();
+        c.out_after_close = std::move(p.out);
+        // Neither list may keep the connection, which is freed once nothing is in flight.
+        if (c.is_unsent) {
+            std::erase(m_unsent, &c);
+            c.is_unsent = false;
+        }
+        if (c.is_ready) {
+            std::erase(m_ready, &c);
+            c.is_ready = false;
+        }
+
+        if (c.inflight > 0) {
+            auto& sqe = m_ring.next_sqe();
+            sqe.opcode = IORING_OP_ASYNC_CANCEL;
+            sqe.fd = c.fd;
+            sqe.cancel_flags = IORING_ASYNC_CANCEL_FD | IORING_ASYNC_CANCEL_ALL;
+            sqe.user_data = user_data(&c, Cancel);
+            ++c.inflight;
+        }
+        release_if_done(c);
+    }
+
+    ~UringEngine() override {
+        for (const auto& [c, _] : m_connections) {
+            ::close(c->fd);
+        }
+        ::close(m_fd);
+    }
+};
+
+std::shared_ptr<Engine> make_uring_engine(int listen_fd, const ServerOptions& options) {
+    if (!kernel_supports_multishot_recv()) {
+        return nullptr;
+    }
+    try {
+        return std::make_shared<UringEngine>(listen_fd, options);
+    } catch (const SocketError&) {
+        return nullptr;
+    }
+}
+
+#endif // __linux__